@@ -0,0 +1,140 @@
+#include "string.h"
+#include "paging.h"
+#include "acpi.h"
+
+enum {
+    EBDA_SEGMENT_PTR = 0x40E,           /* BIOS data area: EBDA segment */
+    EBDA_SEARCH_SIZE = 1024,
+    BIOS_ROM_START = 0xE0000,
+    BIOS_ROM_END = 0x100000
+};
+
+/* Root System Description Pointer, found by scanning memory */
+struct acpi_rsdp {
+    char signature[8];          /* "RSD PTR " */
+    uint8_t checksum;           /* of the first 20 bytes */
+    char oemId[6];
+    uint8_t revision;           /* 0: ACPI 1.0, 2: ACPI 2.0+ */
+    uint32_t rsdtAddress;
+    /* ACPI 2.0+ */
+    uint32_t length;
+    uint64_t xsdtAddress;
+    uint8_t extendedChecksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+/* root table: the header, then 32-bit (RSDT) or 64-bit (XSDT)
+ * physical addresses of the other tables */
+static const acpi_header_t* g_rootTable;
+static unsigned int g_rootEntrySize;
+
+static bool checksumOk(const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; ++i) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+static const struct acpi_rsdp* scanRsdp(uintptr_t start, uintptr_t end) {
+    /* the RSDP sits on a 16-byte boundary */
+    for (uintptr_t addr = start; addr + sizeof(struct acpi_rsdp) <= end; addr += 16) {
+        const struct acpi_rsdp* rsdp = (const struct acpi_rsdp*)physToVirt(addr);
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 && checksumOk(rsdp, 20)) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+/* map a whole table, given its physical address */
+static const acpi_header_t* mapTable(uint64_t phys) {
+    if (phys >= 0x100000000ULL) {
+        return NULL;
+    }
+
+    const acpi_header_t* header = mapPhysical(phys, sizeof(acpi_header_t));
+    uint32_t length = header->length;
+    if (length < sizeof(acpi_header_t)) {
+        return NULL;
+    }
+
+    header = mapPhysical(phys, length);
+    return checksumOk(header, length) ? header : NULL;
+}
+
+/*
+ * Find the root of the ACPI tables. Must be called after pagingInit().
+ *
+ * @returns false if the firmware provides no (valid) ACPI tables
+ */
+bool acpiInit(void) {
+    uint16_t ebdaSegment = *(uint16_t*)physToVirt(EBDA_SEGMENT_PTR);
+    uintptr_t ebda = (uintptr_t)ebdaSegment << 4;
+
+    const struct acpi_rsdp* rsdp = NULL;
+    if (ebda != 0) {
+        rsdp = scanRsdp(ebda, ebda + EBDA_SEARCH_SIZE);
+    }
+    if (rsdp == NULL) {
+        rsdp = scanRsdp(BIOS_ROM_START, BIOS_ROM_END);
+    }
+    if (rsdp == NULL) {
+        return false;
+    }
+
+    /* prefer the XSDT, unless it is out of reach of 32-bit paging */
+    if (rsdp->revision >= 2 && rsdp->xsdtAddress != 0 &&
+            checksumOk(rsdp, rsdp->length)) {
+        g_rootTable = mapTable(rsdp->xsdtAddress);
+        g_rootEntrySize = sizeof(uint64_t);
+    }
+    if (g_rootTable == NULL) {
+        g_rootTable = mapTable(rsdp->rsdtAddress);
+        g_rootEntrySize = sizeof(uint32_t);
+    }
+    if (g_rootTable == NULL) {
+        return false;
+    }
+
+    kprintf("ACPI tables found (%c%c%c%c)\n", g_rootTable->signature[0],
+            g_rootTable->signature[1], g_rootTable->signature[2],
+            g_rootTable->signature[3]);
+    return true;
+}
+
+/*
+ * Find a table by its signature (e.g. "APIC" for the MADT).
+ * Tables are mapped anew on every call, so this is meant for
+ * drivers' one-time setup at boot.
+ *
+ * @returns NULL if there is no such table
+ */
+const acpi_header_t* acpiFindTable(const char* signature) {
+    KASSERT(signature);
+    if (g_rootTable == NULL) {
+        return NULL;
+    }
+
+    const uint8_t* entries = (const uint8_t*)(g_rootTable + 1);
+    unsigned int count = (g_rootTable->length - sizeof(acpi_header_t)) / g_rootEntrySize;
+
+    for (unsigned int i = 0; i < count; ++i) {
+        uint64_t phys;
+        if (g_rootEntrySize == sizeof(uint64_t)) {
+            memcpy(&phys, entries + i * g_rootEntrySize, sizeof(uint64_t));
+        } else {
+            uint32_t phys32;
+            memcpy(&phys32, entries + i * g_rootEntrySize, sizeof(uint32_t));
+            phys = phys32;
+        }
+
+        const acpi_header_t* table = mapTable(phys);
+        if (table != NULL && memcmp(table->signature, signature, 4) == 0) {
+            return table;
+        }
+    }
+
+    return NULL;
+}
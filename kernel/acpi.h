@@ -0,0 +1,39 @@
+#ifndef MAROX_ACPI_H
+#define MAROX_ACPI_H
+
+#include "marox.h"
+
+/*
+ * Just enough ACPI to find the firmware's description tables
+ * (MADT for interrupt routing, HPET, ...).
+ */
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;            /* of the whole table */
+    uint8_t revision;
+    uint8_t checksum;
+    char oemId[6];
+    char oemTableId[8];
+    uint32_t oemRevision;
+    uint32_t creatorId;
+    uint32_t creatorRevision;
+} __attribute__((packed));
+typedef struct acpi_header acpi_header_t;
+
+/* where a register block lives */
+struct acpi_address {
+    uint8_t spaceId;            /* 0: memory, 1: I/O ports */
+    uint8_t bitWidth;
+    uint8_t bitOffset;
+    uint8_t accessSize;
+    uint64_t address;
+} __attribute__((packed));
+typedef struct acpi_address acpi_address_t;
+
+enum { ACPI_SPACE_MEMORY = 0 };
+
+bool acpiInit(void);
+const acpi_header_t* acpiFindTable(const char* signature);
+
+#endif /* MAROX_ACPI_H */
@@ -0,0 +1,457 @@
+#include "x86.h"
+#include "int.h"
+#include "idt.h"
+#include "irq.h"
+#include "paging.h"
+#include "util.h"
+#include "clock.h"
+#include "hrtimer.h"
+#include "acpi.h"
+#include "hpet.h"
+#include "apic.h"
+
+enum {
+    /* local APIC registers, offsets from its base */
+    LAPIC_ID = 0x20,
+    LAPIC_TPR = 0x80,
+    LAPIC_EOI = 0xB0,
+    LAPIC_SVR = 0xF0,
+    LAPIC_LVT_TIMER = 0x320,
+    LAPIC_LVT_LINT0 = 0x350,
+    LAPIC_LVT_LINT1 = 0x360,
+    LAPIC_LVT_ERROR = 0x370,
+    LAPIC_TIMER_INITIAL = 0x380,
+    LAPIC_TIMER_CURRENT = 0x390,
+    LAPIC_TIMER_DIVIDE = 0x3E0,
+
+    LAPIC_SVR_ENABLE = 0x100,
+    LAPIC_LVT_MASKED = 1 << 16,
+    LAPIC_TIMER_ONESHOT = 0 << 17,
+    LAPIC_TIMER_TSC_DEADLINE = 2 << 17,
+    LAPIC_TIMER_DIVIDE_16 = 0x3,
+
+    /* timer events share the PIT's vector, whose IRQ is masked
+     * once another timer takes over */
+    TIMER_VECTOR = 32 + IRQ_TIMER,
+    LAPIC_CALIBRATE_US = 10000,
+
+    MSR_APIC_BASE_ENABLE = 1 << 11,
+
+    /* I/O APIC registers, through the select/window pair */
+    IOAPIC_REGSEL = 0x00,
+    IOAPIC_WINDOW = 0x10,
+    IOAPIC_VERSION = 0x01,
+    IOAPIC_REDIRECTION = 0x10,          /* two registers per entry */
+
+    IOAPIC_ACTIVE_LOW = 1 << 13,
+    IOAPIC_LEVEL = 1 << 15,
+    IOAPIC_MASKED = 1 << 16,
+
+    ISA_IRQS = 16,
+    IRQ_CASCADE = 2,
+
+    /* MADT entries */
+    MADT_IOAPIC = 1,
+    MADT_OVERRIDE = 2,
+    MADT_POLARITY_MASK = 0x3,
+    MADT_POLARITY_LOW = 0x3,
+    MADT_TRIGGER_MASK = 0xC,
+    MADT_TRIGGER_LEVEL = 0xC
+};
+
+/* the ACPI "APIC" table (MADT), followed by variable-length entries */
+struct acpi_madt {
+    acpi_header_t header;
+    uint32_t lapicAddress;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct madt_ioapic {
+    struct madt_entry entry;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsiBase;
+} __attribute__((packed));
+
+struct madt_override {
+    struct madt_entry entry;
+    uint8_t bus;
+    uint8_t irq;
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed));
+
+/* in start.s */
+extern void isr255();
+
+static volatile uint32_t* g_lapic;
+static volatile uint32_t* g_ioapic;
+static uintptr_t g_ioapicBase = IOAPIC_DEFAULT_BASE;
+static unsigned int g_ioapicEntries;
+static bool g_apicEnabled;
+
+/*
+ * Which I/O APIC input each ISA IRQ is wired to. Without firmware
+ * tables saying otherwise (see parseMadt()), assume the usual wiring:
+ * identity, except that the PIT is on input 2 (where the PIC cascade
+ * would be).
+ */
+struct isa_route {
+    uint8_t gsi;
+    bool activeLow;
+    bool level;
+};
+static struct isa_route g_isaRoutes[ISA_IRQS] = {
+    [0] = { 2 }, [1] = { 1 }, [2] = { 0 }, [3] = { 3 },
+    [4] = { 4 }, [5] = { 5 }, [6] = { 6 }, [7] = { 7 },
+    [8] = { 8 }, [9] = { 9 }, [10] = { 10 }, [11] = { 11 },
+    [12] = { 12 }, [13] = { 13 }, [14] = { 14 }, [15] = { 15 }
+};
+
+static inline uint32_t lapicRead(uint32_t reg) {
+    return g_lapic[reg / 4];
+}
+
+static inline void lapicWrite(uint32_t reg, uint32_t value) {
+    g_lapic[reg / 4] = value;
+}
+
+static uint32_t ioapicRead(uint32_t reg) {
+    g_ioapic[IOAPIC_REGSEL / 4] = reg;
+    return g_ioapic[IOAPIC_WINDOW / 4];
+}
+
+static void ioapicWrite(uint32_t reg, uint32_t value) {
+    g_ioapic[IOAPIC_REGSEL / 4] = reg;
+    g_ioapic[IOAPIC_WINDOW / 4] = value;
+}
+
+/*
+ * Signal the end of an interrupt: a single MMIO write, compared
+ * to one or two port writes for the PICs.
+ */
+void lapicEoi(void) {
+    lapicWrite(LAPIC_EOI, 0);
+}
+
+bool apicEnabled(void) {
+    return g_apicEnabled;
+}
+
+/* the cascade input of the PICs has no I/O APIC route of its own */
+static bool isaRouted(unsigned int irq) {
+    return irq != IRQ_CASCADE && g_isaRoutes[irq].gsi < g_ioapicEntries;
+}
+
+/* point an I/O APIC input at a vector, with fixed delivery to this
+ * CPU's local APIC; `low` holds the vector and the input's flags */
+static void ioapicRoute(unsigned int gsi, uint32_t low) {
+    KASSERT(gsi < g_ioapicEntries);
+    uint32_t high = lapicRead(LAPIC_ID) & 0xFF000000;
+
+    ioapicWrite(IOAPIC_REDIRECTION + 2 * gsi + 1, high);
+    ioapicWrite(IOAPIC_REDIRECTION + 2 * gsi, low);
+}
+
+/*
+ * Mask or unmask an ISA IRQ at the I/O APIC.
+ * Called with interrupts disabled.
+ */
+void ioapicSetMasked(unsigned int irq, bool masked) {
+    KASSERT(irq < ISA_IRQS);
+    if (!isaRouted(irq)) {
+        return;
+    }
+
+    struct isa_route* route = &g_isaRoutes[irq];
+    uint32_t low = (32 + irq);
+    if (route->activeLow) {
+        low |= IOAPIC_ACTIVE_LOW;
+    }
+    if (route->level) {
+        low |= IOAPIC_LEVEL;
+    }
+    if (masked) {
+        low |= IOAPIC_MASKED;
+    }
+
+    ioapicRoute(route->gsi, low);
+}
+
+/*
+ * Record that an ISA IRQ is wired to another I/O APIC input, or with
+ * another polarity or trigger mode (as firmware tables report).
+ * Must be called before apicInit().
+ */
+void ioapicSetOverride(unsigned int irq, unsigned int gsi, bool activeLow, bool levelTriggered) {
+    KASSERT(irq < ISA_IRQS);
+    KASSERT(!g_apicEnabled);
+
+    /* an input taken over by another IRQ loses its identity route */
+    for (unsigned int i = 0; i < ISA_IRQS; ++i) {
+        if (i != irq && g_isaRoutes[i].gsi == gsi) {
+            g_isaRoutes[i].gsi = 0xFF;
+        }
+    }
+
+    g_isaRoutes[irq].gsi = gsi;
+    g_isaRoutes[irq].activeLow = activeLow;
+    g_isaRoutes[irq].level = levelTriggered;
+}
+
+/*
+ * Take the I/O APIC's address and the ISA IRQ wiring from the ACPI
+ * MADT, if there is one. Only the first I/O APIC is used.
+ */
+static void parseMadt(void) {
+    const struct acpi_madt* madt = (const struct acpi_madt*)acpiFindTable("APIC");
+    if (madt == NULL) {
+        return;
+    }
+
+    /* the table lists every deviation from identity wiring */
+    for (unsigned int irq = 0; irq < ISA_IRQS; ++irq) {
+        g_isaRoutes[irq].gsi = irq;
+        g_isaRoutes[irq].activeLow = false;
+        g_isaRoutes[irq].level = false;
+    }
+
+    bool haveIoApic = false;
+    const uint8_t* p = (const uint8_t*)(madt + 1);
+    const uint8_t* end = (const uint8_t*)madt + madt->header.length;
+
+    while (p + sizeof(struct madt_entry) <= end) {
+        const struct madt_entry* entry = (const struct madt_entry*)p;
+        if (entry->length < sizeof(struct madt_entry) || p + entry->length > end) {
+            break;
+        }
+
+        if (entry->type == MADT_IOAPIC && !haveIoApic &&
+                entry->length >= sizeof(struct madt_ioapic)) {
+            const struct madt_ioapic* ioapic = (const struct madt_ioapic*)entry;
+            if (ioapic->gsiBase == 0) {
+                g_ioapicBase = ioapic->address;
+                haveIoApic = true;
+            }
+        } else if (entry->type == MADT_OVERRIDE &&
+                entry->length >= sizeof(struct madt_override)) {
+            const struct madt_override* override = (const struct madt_override*)entry;
+            /* polarity and trigger 0 mean "as the bus says", which
+             * for ISA is active high and edge-triggered */
+            if (override->bus == 0 && override->irq < ISA_IRQS) {
+                ioapicSetOverride(override->irq, override->gsi,
+                        (override->flags & MADT_POLARITY_MASK) == MADT_POLARITY_LOW,
+                        (override->flags & MADT_TRIGGER_MASK) == MADT_TRIGGER_LEVEL);
+            }
+        }
+
+        p += entry->length;
+    }
+}
+
+static void spuriousHandler(struct regs* r) {
+    (void)r;
+    /* not a real interrupt: no EOI */
+}
+
+/* local APIC timer */
+
+static uint32_t g_lapicTimerKhz;
+
+static void lapicSetNextEventTscDeadline(uint64_t delta) {
+    wrmsr(MSR_TSC_DEADLINE, readTsc() + delta * tscKhz() / NSEC_PER_MSEC);
+}
+
+static void lapicSetNextEventOneShot(uint64_t delta) {
+    uint64_t count = delta * g_lapicTimerKhz / NSEC_PER_MSEC;
+    if (count < 1) {
+        count = 1;
+    }
+    if (count > 0xFFFFFFFF) {
+        count = 0xFFFFFFFF;
+    }
+    lapicWrite(LAPIC_TIMER_INITIAL, count);
+}
+
+static clock_event_t g_lapicClockEvent;
+
+/*
+ * Drive hrtimers from the local APIC timer: in TSC-deadline mode if
+ * the CPU has it and the TSC is the clock source, else one-shot at a
+ * rate timed against the clock. Called with interrupts disabled.
+ *
+ * @returns false if the timer cannot be used
+ */
+static bool lapicTimerInit(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    g_lapicClockEvent.minDelta = NSEC_PER_USEC;
+
+    if ((ecx & CPUID_1_ECX_TSC_DEADLINE) && tscKhz() != 0) {
+        lapicWrite(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | TIMER_VECTOR);
+        g_lapicClockEvent.name = "local APIC timer (TSC deadline)";
+        /* any delay that does not overflow the TSC arithmetic */
+        g_lapicClockEvent.maxDelta = (uint64_t)NSEC_PER_SEC * 60;
+        g_lapicClockEvent.setNextEvent = lapicSetNextEventTscDeadline;
+    } else {
+        /* count down from the maximum for a while, masked */
+        lapicWrite(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+        lapicWrite(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_ONESHOT | TIMER_VECTOR);
+        lapicWrite(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+        udelay(LAPIC_CALIBRATE_US);
+        uint32_t counted = 0xFFFFFFFF - lapicRead(LAPIC_TIMER_CURRENT);
+        lapicWrite(LAPIC_TIMER_INITIAL, 0);
+
+        g_lapicTimerKhz = counted / (LAPIC_CALIBRATE_US / 1000);
+        if (g_lapicTimerKhz == 0) {
+            kprintf("Local APIC timer does not count\n");
+            return false;
+        }
+
+        lapicWrite(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | TIMER_VECTOR);
+        g_lapicClockEvent.name = "local APIC timer (one-shot)";
+        g_lapicClockEvent.maxDelta = 0xFFFFFFFFULL * NSEC_PER_MSEC / g_lapicTimerKhz;
+        g_lapicClockEvent.setNextEvent = lapicSetNextEventOneShot;
+    }
+
+    /* the PIT's interrupt would now only duplicate the timer's */
+    disableIrq(IRQ_TIMER);
+    clockEventRegister(&g_lapicClockEvent);
+    return true;
+}
+
+/*
+ * Drive hrtimers from the HPET, preferably on the PIT's I/O APIC input
+ * (which is already routed to the timer vector), else on an input no
+ * ISA IRQ uses. Called with interrupts disabled.
+ *
+ * @returns false if the HPET cannot be used
+ */
+static bool hpetTimerInit(void) {
+    uint32_t cap = hpetRouteCap();
+
+    unsigned int gsi = g_isaRoutes[IRQ_TIMER].gsi;
+    if (isaRouted(IRQ_TIMER) && (cap & (1U << gsi))) {
+        /* the PIT is no longer reprogrammed, so at most one stray
+         * interrupt of its own follows */
+        return hpetEventStart(gsi);
+    }
+
+    for (gsi = ISA_IRQS; gsi < g_ioapicEntries && gsi < 32; ++gsi) {
+        if (!(cap & (1U << gsi))) {
+            continue;
+        }
+
+        ioapicRoute(gsi, TIMER_VECTOR);
+        if (!hpetEventStart(gsi)) {
+            ioapicRoute(gsi, IOAPIC_MASKED);
+            return false;
+        }
+        disableIrq(IRQ_TIMER);
+        return true;
+    }
+
+    return false;
+}
+
+/* does the local APIC timer keep running in deep C-states? */
+static bool lapicTimerAlwaysRunning(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 6) {
+        return false;
+    }
+    cpuid(6, &eax, &ebx, &ecx, &edx);
+    return (eax & CPUID_6_EAX_ARAT) != 0;
+}
+
+/*
+ * Pick the timer event device: the local APIC timer if it is cheap to
+ * program and always running, else the HPET, else the local APIC timer
+ * anyway; failing all of those the PIT stays in charge.
+ * The local APIC timer is calibrated against the clock, so it is only
+ * used with a better clock than the PIT.
+ */
+static void timerEventInit(void) {
+    bool lapicUsable = clockSource() != CLOCK_SOURCE_PIT;
+
+    if (lapicUsable && lapicTimerAlwaysRunning() && lapicTimerInit()) {
+        return;
+    }
+    if (hpetTimerInit()) {
+        return;
+    }
+    if (lapicUsable) {
+        lapicTimerInit();
+    }
+}
+
+/*
+ * Switch interrupt handling from the 8259 PICs to the local APIC and
+ * I/O APIC, if the machine has them. Must be called after pagingInit(),
+ * acpiInit(), hpetInit() and clockInit().
+ *
+ * @returns false if the PICs are still in use
+ */
+bool apicInit(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    if (!cpuidSupported()) {
+        return false;
+    }
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_1_EDX_APIC) || !(edx & CPUID_1_EDX_MSR)) {
+        return false;
+    }
+
+    bool iFlag = begIntAtomic();
+
+    parseMadt();
+
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    g_lapic = mapMmio(base & 0xFFFFF000, 0x1000);
+    g_ioapic = mapMmio(g_ioapicBase, 0x1000);
+
+    uint32_t version = ioapicRead(IOAPIC_VERSION);
+    if (version == 0xFFFFFFFF) {
+        endIntAtomic(iFlag);
+        kprintf("No I/O APIC found, keeping the PICs\n");
+        return false;
+    }
+    g_ioapicEntries = ((version >> 16) & 0xFF) + 1;
+
+    /* enable the local APIC, accepting all interrupt priorities */
+    wrmsr(MSR_APIC_BASE, base | MSR_APIC_BASE_ENABLE);
+    idtSetIntGate(APIC_SPURIOUS_VECTOR, (uintptr_t)isr255, KERNEL_DPL);
+    installIntHandler(APIC_SPURIOUS_VECTOR, spuriousHandler);
+    lapicWrite(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    lapicWrite(LAPIC_TPR, 0);
+
+    /* the PICs' output (LINT0) is not used anymore, nor are errors */
+    lapicWrite(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapicWrite(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+
+    /* start with every input masked; the IRQ code unmasks those
+     * enabled at the PICs */
+    for (unsigned int i = 0; i < g_ioapicEntries; ++i) {
+        ioapicWrite(IOAPIC_REDIRECTION + 2 * i, IOAPIC_MASKED);
+        ioapicWrite(IOAPIC_REDIRECTION + 2 * i + 1, 0);
+    }
+
+    g_apicEnabled = true;
+    irqUseIoApic();
+
+    timerEventInit();
+
+    endIntAtomic(iFlag);
+
+    kprintf("Local APIC and I/O APIC enabled (%u inputs)\n", g_ioapicEntries);
+    return true;
+}
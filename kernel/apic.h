@@ -0,0 +1,28 @@
+#ifndef MAROX_APIC_H
+#define MAROX_APIC_H
+
+#include "marox.h"
+
+/*
+ * Local APIC and I/O APIC.
+ *
+ * When both are present, the 8259 PICs are masked and ISA IRQs are
+ * routed through the I/O APIC to the same vectors (32-47) instead, so
+ * the IRQ handlers do not change; only the EOI does, becoming a single
+ * MMIO write. The local APIC timer or the HPET also takes over timer
+ * events from the PIT (see timerEventInit()). Firmware's ACPI MADT,
+ * if any, says where the I/O APIC is and how ISA IRQs are wired to it.
+ */
+
+enum {
+    IOAPIC_DEFAULT_BASE = 0xFEC00000,
+    APIC_SPURIOUS_VECTOR = 0xFF
+};
+
+bool apicInit(void);
+bool apicEnabled(void);
+void lapicEoi(void);
+void ioapicSetMasked(unsigned int irq, bool masked);
+void ioapicSetOverride(unsigned int irq, unsigned int gsi, bool activeLow, bool levelTriggered);
+
+#endif /* MAROX_APIC_H */
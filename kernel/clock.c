@@ -0,0 +1,263 @@
+#include "io.h"
+#include "int.h"
+#include "util.h"
+#include "x86.h"
+#include "timer.h"
+#include "hpet.h"
+#include "clock.h"
+
+/*
+ * Monotonic nanosecond clock.
+ *
+ * At boot, the TSC is timed a few times over against the HPET's main
+ * counter, or without an HPET against PIT channel 2 (which is otherwise
+ * only used for the speaker). The TSC is used if the CPU says it runs
+ * at a constant rate regardless of power state (invariant TSC) and the
+ * calibration runs agree; otherwise the clock falls back to the HPET's
+ * counter, or failing that to the PIT's one-shot counter (see timer.c).
+ */
+
+enum {
+    CALIBRATE_RUNS = 5,
+    CALIBRATE_MS = 10,
+    CALIBRATE_TOLERANCE = 1000,         /* runs must agree to 1/1000 */
+
+    PIT_SPKR_GATE2 = 0x01,              /* gate input of channel 2 */
+    PIT_SPKR_ENABLE = 0x02,             /* channel 2 output to speaker */
+    PIT_SPKR_OUT2 = 0x20,               /* output of channel 2 */
+
+    PIT_CMD_CH2_ONESHOT = 0xB0,         /* channel 2, LSB then MSB, mode 0 */
+
+    CALIBRATE_COUNT = PIT_FREQ_HZ / 1000 * CALIBRATE_MS
+};
+
+static clock_source_t g_clockSource = CLOCK_SOURCE_PIT;
+
+/* ns = nsBase + (((counter - base) * mult) >> shift) */
+struct counter_scale {
+    uint64_t base;
+    uint64_t nsBase;
+    uint32_t mult;
+    uint32_t shift;
+};
+
+static struct counter_scale g_tscScale;
+static struct counter_scale g_hpetScale;
+static uint32_t g_tscKhz;
+
+/* last value returned, so the clock never runs backwards */
+static uint64_t g_lastNanos;
+static uint64_t g_lastTsc;
+
+static bool tscInvariant(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    if (!cpuidSupported()) {
+        return false;
+    }
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_1_EDX_TSC)) {
+        return false;
+    }
+
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000007) {
+        return false;
+    }
+    cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx & CPUID_80000007_EDX_INVARIANT_TSC) != 0;
+}
+
+/*
+ * TSC cycles during CALIBRATE_COUNT clocks (about CALIBRATE_MS
+ * milliseconds) of PIT channel 2.
+ * Called with interrupts disabled.
+ */
+static uint64_t calibratePit(void) {
+    uint16_t count = CALIBRATE_COUNT;
+    uint8_t spkr = inPortB(PIT_SPKR_REG);
+
+    /* gate on, speaker off; channel 2 counts down once and
+     * raises its output when it reaches zero */
+    outPortB(PIT_SPKR_REG, (spkr & ~PIT_SPKR_ENABLE) | PIT_SPKR_GATE2);
+    outPortB(PIT_CMD_REG, PIT_CMD_CH2_ONESHOT);
+    outPortB(PIT_DATA_REG2, count & 0xFF);
+    outPortB(PIT_DATA_REG2, count >> 8);
+
+    uint64_t start = readTsc();
+    while (!(inPortB(PIT_SPKR_REG) & PIT_SPKR_OUT2)) ;
+    uint64_t end = readTsc();
+
+    outPortB(PIT_SPKR_REG, spkr);
+
+    return end - start;
+}
+
+/*
+ * TSC cycles during about CALIBRATE_MS milliseconds of the HPET's
+ * counter, scaled to exactly CALIBRATE_COUNT PIT clocks' worth so both
+ * references give comparable results.
+ * Called with interrupts disabled.
+ */
+static uint64_t calibrateHpet(void) {
+    uint64_t ticks = (uint64_t)hpetKhz() * CALIBRATE_MS;
+
+    uint64_t hpetStart = hpetCounter();
+    uint64_t start = readTsc();
+    uint64_t hpetEnd;
+    do {
+        hpetEnd = hpetCounter();
+    } while (hpetEnd - hpetStart < ticks);
+    uint64_t end = readTsc();
+
+    /* cycles * (CALIBRATE_COUNT / PIT_FREQ_HZ) / (elapsed / hpetKhz / 1000) */
+    return (end - start) * CALIBRATE_COUNT * hpetKhz() / PIT_FREQ_HZ * 1000 / (hpetEnd - hpetStart);
+}
+
+/* time since timerInit() from the PIT alone */
+static uint64_t pitNanos(void) {
+    return pitClocks() * NSEC_PER_SEC / PIT_FREQ_HZ;
+}
+
+/* pick mult and shift for a counter running at khz */
+static void scaleInit(struct counter_scale* scale, uint32_t khz) {
+    /* largest shift for which the multiplier fits 32 bits */
+    scale->shift = 32;
+    while (((uint64_t)NSEC_PER_MSEC << scale->shift) / khz > 0xFFFFFFFF) {
+        --scale->shift;
+    }
+    scale->mult = ((uint64_t)NSEC_PER_MSEC << scale->shift) / khz;
+}
+
+/* counter value to nanoseconds, without overflowing 64 bits */
+static uint64_t scaleNanos(const struct counter_scale* scale, uint64_t counter) {
+    uint64_t cycles = counter - scale->base;
+    uint64_t hi = (cycles >> 32) * scale->mult;
+    uint64_t lo = (cycles & 0xFFFFFFFF) * scale->mult;
+    return scale->nsBase + (hi << (32 - scale->shift)) + (lo >> scale->shift);
+}
+
+/* make the HPET the clock source, carrying on from nsBase */
+static void useHpet(uint64_t nsBase) {
+    g_hpetScale.nsBase = nsBase;
+    g_hpetScale.base = hpetCounter();
+    g_clockSource = CLOCK_SOURCE_HPET;
+}
+
+/*
+ * Pick the clock source. Must be called after timerInit(), and after
+ * hpetInit() for the HPET to be used, with interrupts enabled.
+ */
+void clockInit(void) {
+    KASSERT(interruptsEnabled());
+
+    bool hpet = hpetAvailable();
+    if (hpet) {
+        bool iFlag = begIntAtomic();
+        scaleInit(&g_hpetScale, hpetKhz());
+        /* carry on from the PIT's time, so both sources agree */
+        useHpet(pitNanos());
+        endIntAtomic(iFlag);
+    }
+    const char* fallback = hpet ? "HPET" : "PIT";
+
+    if (!tscInvariant()) {
+        kprintf("Clock source: %s (no invariant TSC)\n", fallback);
+        return;
+    }
+
+    /* interrupts are held off for one run at a time only: in between,
+     * the tick gets to reprogram the PIT, whose clock would lose time
+     * if left unprogrammed for longer than it can count (see timer.c) */
+    uint64_t best = 0, worst = 0;
+    for (int i = 0; i < CALIBRATE_RUNS; ++i) {
+        bool iFlag = begIntAtomic();
+        uint64_t cycles = hpet ? calibrateHpet() : calibratePit();
+        endIntAtomic(iFlag);
+        if (i == 0 || cycles < best) {
+            best = cycles;
+        }
+        if (cycles > worst) {
+            worst = cycles;
+        }
+    }
+
+    /* runs that disagree mean the TSC (or the emulation of it)
+     * does not tick steadily */
+    if (best == 0 || (worst - best) * CALIBRATE_TOLERANCE > best) {
+        kprintf("Clock source: %s (TSC calibration unstable)\n", fallback);
+        return;
+    }
+
+    bool iFlag = begIntAtomic();
+
+    g_tscKhz = best * PIT_FREQ_HZ / ((uint64_t)CALIBRATE_COUNT * 1000);
+    scaleInit(&g_tscScale, g_tscKhz);
+
+    /* carry on from the previous source's time, so both agree */
+    g_tscScale.nsBase = hpet ? scaleNanos(&g_hpetScale, hpetCounter()) : pitNanos();
+    g_tscScale.base = readTsc();
+    g_lastTsc = g_tscScale.base;
+    g_clockSource = CLOCK_SOURCE_TSC;
+
+    endIntAtomic(iFlag);
+
+    kprintf("Clock source: TSC at %u kHz (calibrated against the %s)\n", g_tscKhz, fallback);
+}
+
+/*
+ * Nanoseconds since boot. Never decreases.
+ * May be called from interrupt handlers.
+ */
+uint64_t clockNanos(void) {
+    uint64_t now;
+
+    bool iFlag = begIntAtomic();
+
+    if (g_clockSource == CLOCK_SOURCE_TSC) {
+        uint64_t tsc = readTsc();
+        if (tsc >= g_lastTsc) {
+            g_lastTsc = tsc;
+            now = scaleNanos(&g_tscScale, tsc);
+        } else if (hpetAvailable()) {
+            /* the TSC went backwards (e.g. reset by firmware):
+             * stop trusting it */
+            useHpet(g_lastNanos);
+            now = g_lastNanos;
+        } else {
+            g_clockSource = CLOCK_SOURCE_PIT;
+            now = pitNanos();
+        }
+    } else if (g_clockSource == CLOCK_SOURCE_HPET) {
+        now = scaleNanos(&g_hpetScale, hpetCounter());
+    } else {
+        now = pitNanos();
+    }
+
+    if (now < g_lastNanos) {
+        now = g_lastNanos;
+    }
+    g_lastNanos = now;
+
+    endIntAtomic(iFlag);
+
+    return now;
+}
+
+clock_source_t clockSource(void) {
+    return g_clockSource;
+}
+
+/* calibrated TSC frequency, or 0 if the TSC is not used */
+uint32_t tscKhz(void) {
+    return (g_clockSource == CLOCK_SOURCE_TSC) ? g_tscKhz : 0;
+}
+
+/*
+ * Busy-wait for (at least) the given number of microseconds.
+ */
+void udelay(unsigned int microseconds) {
+    uint64_t end = clockNanos() + (uint64_t)microseconds * NSEC_PER_USEC;
+    while (clockNanos() < end) ;
+}
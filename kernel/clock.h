@@ -0,0 +1,33 @@
+#ifndef MAROX_CLOCK_H
+#define MAROX_CLOCK_H
+
+#include "marox.h"
+
+enum {
+    NSEC_PER_USEC = 1000,
+    NSEC_PER_MSEC = 1000000,
+    NSEC_PER_SEC = 1000000000
+};
+
+/*
+ * Where clockNanos() gets its time from.
+ * TSC: the CPU's time stamp counter, calibrated against the HPET
+ *      or the PIT.
+ * HPET: the HPET's main counter; used when the TSC is missing or
+ *      cannot be trusted to run at a constant rate.
+ * PIT: the PIT's channel 0 counter (about 838 ns resolution); used
+ *      when there is neither.
+ */
+typedef enum {
+    CLOCK_SOURCE_PIT,
+    CLOCK_SOURCE_HPET,
+    CLOCK_SOURCE_TSC
+} clock_source_t;
+
+void clockInit(void);
+uint64_t clockNanos(void);
+clock_source_t clockSource(void);
+uint32_t tscKhz(void);
+void udelay(unsigned int microseconds);
+
+#endif /* MAROX_CLOCK_H */
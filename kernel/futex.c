@@ -0,0 +1,122 @@
+#include "int.h"
+#include "thread.h"
+#include "paging.h"
+#include "futex.h"
+
+/*
+ * A thread sleeping in futexWait(). Lives on the sleeper's stack;
+ * each has a queue of its own so futexWake() can wake exactly the
+ * threads waiting on its address.
+ */
+struct futex_waiter {
+    volatile uint32_t* addr;
+    thread_queue_t queue;
+    struct futex_waiter* next;
+};
+
+/* waiters by address hash, oldest first */
+static struct futex_waiter* futexBuckets[FUTEX_BUCKETS];
+
+static struct futex_waiter** bucketOf(volatile uint32_t* addr) {
+    /* drop the alignment bits, then fold the rest */
+    uint32_t key = (uintptr_t)addr >> 2;
+    key ^= key >> FUTEX_HASH_BITS;
+    key ^= key >> (2 * FUTEX_HASH_BITS);
+    return &futexBuckets[key & (FUTEX_BUCKETS - 1)];
+}
+
+/* futexes are system calls: the word must be user memory, checked
+ * before it is read */
+static bool validAddr(volatile uint32_t* addr) {
+    return ((uintptr_t)addr & 3) == 0 && userAccessible(addr, sizeof(uint32_t));
+}
+
+/* @returns whether the waiter was still in the bucket */
+static bool unlinkWaiter(struct futex_waiter** bucket, struct futex_waiter* waiter) {
+    for (struct futex_waiter** w = bucket; *w != NULL; w = &(*w)->next) {
+        if (*w == waiter) {
+            *w = waiter->next;
+            waiter->next = NULL;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Sleep until woken by futexWake() on the same address, provided the
+ * word at `addr` still holds `expected`. Checking the word and going
+ * to sleep happen atomically, so a wakeup sent after the caller last
+ * looked at the word cannot be lost.
+ *
+ * @returns 0 when woken, -1 if the word no longer held `expected`
+ *          (or addr is invalid), -2 if the wait was cancelled
+ *          (cancelWait) rather than ended by futexWake()
+ */
+int futexWait(volatile uint32_t* addr, uint32_t expected) {
+    if (!validAddr(addr)) {
+        return -1;
+    }
+
+    bool iFlag = begIntAtomic();
+
+    if (*addr != expected) {
+        endIntAtomic(iFlag);
+        return -1;
+    }
+
+    struct futex_waiter waiter;
+    waiter.addr = addr;
+    waiter.next = NULL;
+    threadQueueClear(&waiter.queue);
+
+    struct futex_waiter** bucket = bucketOf(addr);
+    struct futex_waiter** w = bucket;
+    while (*w != NULL) {
+        w = &(*w)->next;
+    }
+    *w = &waiter;
+
+    wait(&waiter.queue);
+
+    /* futexWake() unlinks the waiters it wakes, so one still linked
+     * was woken some other way (cancelWait) */
+    bool cancelled = unlinkWaiter(bucket, &waiter);
+
+    endIntAtomic(iFlag);
+
+    return cancelled ? -2 : 0;
+}
+
+/*
+ * Wake up to `count` threads sleeping on `addr`, oldest first.
+ *
+ * @returns the number of threads woken, or -1 if addr is invalid
+ */
+int futexWake(volatile uint32_t* addr, unsigned int count) {
+    if (!validAddr(addr)) {
+        return -1;
+    }
+
+    int woken = 0;
+
+    bool iFlag = begIntAtomic();
+
+    struct futex_waiter** w = bucketOf(addr);
+    while (*w != NULL && (unsigned int)woken < count) {
+        struct futex_waiter* waiter = *w;
+        if (waiter->addr != addr) {
+            w = &waiter->next;
+            continue;
+        }
+
+        *w = waiter->next;
+        waiter->next = NULL;
+        wakeOne(&waiter->queue);
+        ++woken;
+    }
+
+    endIntAtomic(iFlag);
+
+    return woken;
+}
@@ -0,0 +1,22 @@
+#ifndef MAROX_FUTEX_H
+#define MAROX_FUTEX_H
+
+#include "marox.h"
+
+/*
+ * Fast user-space locking: a lock or condition lives in a 32-bit word
+ * in user memory and is manipulated there with atomic instructions.
+ * Only on contention does a thread enter the kernel, to sleep until
+ * the word changes (futexWait) or to wake sleepers (futexWake).
+ *
+ * Waiters are kept in a small hash table of buckets keyed by address.
+ */
+enum {
+    FUTEX_HASH_BITS = 5,
+    FUTEX_BUCKETS = 1 << FUTEX_HASH_BITS
+};
+
+int futexWait(volatile uint32_t* addr, uint32_t expected);
+int futexWake(volatile uint32_t* addr, unsigned int count);
+
+#endif /* MAROX_FUTEX_H */
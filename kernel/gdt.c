@@ -104,7 +104,9 @@ struct tss {
 /* GDT and special global GDT pointer */
 static struct segmentDescriptor g_gdt[GDT_NUM_ENTRIES];
 struct gdt_ptr g_gdt_ptr;
-static struct tss g_tss;
+/* not static: switchToThread in start.s updates esp0 directly */
+struct tss g_tss;
+_Static_assert(offsetof(struct tss, esp0) == 4, "start.s expects esp0 at offset 4");
 
 
 static uint16_t gdtSelector(struct segmentDescriptor* sd) {
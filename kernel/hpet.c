@@ -0,0 +1,210 @@
+#include "int.h"
+#include "acpi.h"
+#include "paging.h"
+#include "clock.h"
+#include "hrtimer.h"
+#include "hpet.h"
+
+enum {
+    /* registers, offsets from the base; all 64 bits wide */
+    HPET_GCAP_ID = 0x000,
+    HPET_GEN_CONF = 0x010,
+    HPET_MAIN_COUNTER = 0x0F0,
+    HPET_TIMER_CONF = 0x100,            /* plus 0x20 per timer */
+    HPET_TIMER_COMPARATOR = 0x108,
+    HPET_TIMER_STRIDE = 0x20,
+    HPET_REGS_SIZE = 0x400,
+
+    HPET_GCAP_COUNT_SIZE_64 = 1 << 13,
+    HPET_GCAP_NUM_TIMERS_SHIFT = 8,
+    HPET_MAX_PERIOD_FS = 100000000,     /* 100 ns, per the specification */
+
+    HPET_CONF_ENABLE = 1 << 0,
+    HPET_CONF_LEGACY = 1 << 1,
+
+    HPET_TN_LEVEL = 1 << 1,
+    HPET_TN_INT_ENABLE = 1 << 2,
+    HPET_TN_PERIODIC = 1 << 3,
+    HPET_TN_32BIT = 1 << 8,
+    HPET_TN_ROUTE_SHIFT = 9,
+    HPET_TN_ROUTE_MASK = 0x1F << 9,
+    HPET_TN_FSB = 1 << 14,
+
+    FS_PER_NSEC = 1000000,
+    /* comparator deltas are limited so 32-bit comparisons never wrap */
+    HPET_MAX_TICKS = 0x80000000U
+};
+
+/* the ACPI "HPET" table */
+struct acpi_hpet {
+    acpi_header_t header;
+    uint32_t blockId;
+    acpi_address_t address;
+    uint8_t number;
+    uint16_t minimumTick;       /* for periodic mode, in counter ticks */
+    uint8_t attributes;
+} __attribute__((packed));
+
+static volatile uint32_t* g_hpet;
+static uint32_t g_hpetPeriodFs;         /* counter period in femtoseconds */
+static uint32_t g_hpetKhz;
+static uint32_t g_hpetMinTicks;
+
+static inline uint32_t hpetRead(uint32_t reg) {
+    return g_hpet[reg / 4];
+}
+
+static inline void hpetWrite(uint32_t reg, uint32_t value) {
+    g_hpet[reg / 4] = value;
+}
+
+/*
+ * Find the HPET and start its main counter.
+ * Must be called after acpiInit().
+ *
+ * @returns false if there is no (usable) HPET
+ */
+bool hpetInit(void) {
+    const struct acpi_hpet* table = (const struct acpi_hpet*)acpiFindTable("HPET");
+    if (table == NULL || table->header.length < sizeof(struct acpi_hpet)) {
+        return false;
+    }
+    if (table->address.spaceId != ACPI_SPACE_MEMORY ||
+            table->address.address >= 0x100000000ULL) {
+        return false;
+    }
+
+    bool iFlag = begIntAtomic();
+
+    g_hpet = mapMmio(table->address.address, HPET_REGS_SIZE);
+
+    uint32_t caps = hpetRead(HPET_GCAP_ID);
+    uint32_t period = hpetRead(HPET_GCAP_ID + 4);
+
+    /* a 32-bit counter wraps every few minutes, too often to be
+     * worth keeping track of */
+    if (!(caps & HPET_GCAP_COUNT_SIZE_64) || period == 0 || period > HPET_MAX_PERIOD_FS) {
+        g_hpet = NULL;
+        endIntAtomic(iFlag);
+        kprintf("HPET not usable (caps 0x%x, period %u fs)\n", caps, period);
+        return false;
+    }
+
+    g_hpetPeriodFs = period;
+    g_hpetKhz = 1000000000000ULL / period;
+    g_hpetMinTicks = table->minimumTick;
+
+    /* halt the counter, leave legacy replacement routing off (it
+     * would take the RTC's IRQ 8) and silence every comparator */
+    hpetWrite(HPET_GEN_CONF, hpetRead(HPET_GEN_CONF) & ~(HPET_CONF_ENABLE | HPET_CONF_LEGACY));
+    unsigned int timers = ((caps >> HPET_GCAP_NUM_TIMERS_SHIFT) & 0x1F) + 1;
+    for (unsigned int i = 0; i < timers; ++i) {
+        uint32_t reg = HPET_TIMER_CONF + i * HPET_TIMER_STRIDE;
+        hpetWrite(reg, hpetRead(reg) & ~(HPET_TN_INT_ENABLE | HPET_TN_PERIODIC | HPET_TN_FSB));
+    }
+
+    hpetWrite(HPET_MAIN_COUNTER, 0);
+    hpetWrite(HPET_MAIN_COUNTER + 4, 0);
+    hpetWrite(HPET_GEN_CONF, hpetRead(HPET_GEN_CONF) | HPET_CONF_ENABLE);
+
+    endIntAtomic(iFlag);
+
+    kprintf("HPET at 0x%x, %u kHz, %u timers\n", (uint32_t)table->address.address,
+            g_hpetKhz, timers);
+    return true;
+}
+
+bool hpetAvailable(void) {
+    return g_hpet != NULL;
+}
+
+/*
+ * Read the 64-bit main counter, which can only be read in two
+ * halves; retry if the low half wrapped in between.
+ */
+uint64_t hpetCounter(void) {
+    KASSERT(g_hpet);
+
+    uint32_t high, low;
+    do {
+        high = hpetRead(HPET_MAIN_COUNTER + 4);
+        low = hpetRead(HPET_MAIN_COUNTER);
+    } while (hpetRead(HPET_MAIN_COUNTER + 4) != high);
+
+    return ((uint64_t)high << 32) | low;
+}
+
+/* counter frequency, or 0 if there is no HPET */
+uint32_t hpetKhz(void) {
+    return g_hpet != NULL ? g_hpetKhz : 0;
+}
+
+/* bitmap of the I/O APIC inputs timer 0 can interrupt on */
+uint32_t hpetRouteCap(void) {
+    return g_hpet != NULL ? hpetRead(HPET_TIMER_CONF + 4) : 0;
+}
+
+/* timer 0 as an event device */
+
+static void hpetSetNextEvent(uint64_t delta) {
+    uint64_t ticks = delta * g_hpetKhz / NSEC_PER_MSEC;
+    if (ticks < g_hpetMinTicks) {
+        ticks = g_hpetMinTicks;
+    }
+    if (ticks > HPET_MAX_TICKS) {
+        ticks = HPET_MAX_TICKS;
+    }
+
+    /* the comparator only fires when the counter passes it; if the
+     * counter got there while it was being written, the event would
+     * be lost, so try again further ahead */
+    uint32_t target;
+    do {
+        target = hpetRead(HPET_MAIN_COUNTER) + (uint32_t)ticks;
+        hpetWrite(HPET_TIMER_COMPARATOR, target);
+        if (ticks < HPET_MAX_TICKS / 2) {
+            ticks *= 2;
+        }
+    } while ((int32_t)(hpetRead(HPET_MAIN_COUNTER) - target) >= 0);
+}
+
+static clock_event_t g_hpetClockEvent = {
+    .name = "HPET",
+    .setNextEvent = hpetSetNextEvent
+};
+
+/*
+ * Drive hrtimers from HPET timer 0, in one-shot mode, interrupting
+ * on the given I/O APIC input (which the caller routes to the timer
+ * vector). Called with interrupts disabled.
+ *
+ * @returns false if timer 0 cannot interrupt on that input
+ */
+bool hpetEventStart(unsigned int gsi) {
+    KASSERT(!interruptsEnabled());
+    if (g_hpet == NULL || gsi >= 32 || !(hpetRouteCap() & (1U << gsi))) {
+        return false;
+    }
+
+    /* edge-triggered, comparing the low 32 bits of the counter */
+    uint32_t conf = hpetRead(HPET_TIMER_CONF);
+    conf &= ~(HPET_TN_LEVEL | HPET_TN_PERIODIC | HPET_TN_FSB | HPET_TN_ROUTE_MASK);
+    conf |= HPET_TN_32BIT | (gsi << HPET_TN_ROUTE_SHIFT);
+    hpetWrite(HPET_TIMER_CONF, conf);
+    if (((hpetRead(HPET_TIMER_CONF) & HPET_TN_ROUTE_MASK) >> HPET_TN_ROUTE_SHIFT) != gsi) {
+        return false;
+    }
+
+    /* the minimum tick is meant for periodic mode, but is also a
+     * fair bound on how close a one-shot event can be */
+    g_hpetClockEvent.minDelta = (uint64_t)(g_hpetMinTicks + 1) * g_hpetPeriodFs / FS_PER_NSEC;
+    if (g_hpetClockEvent.minDelta < NSEC_PER_USEC) {
+        g_hpetClockEvent.minDelta = NSEC_PER_USEC;
+    }
+    g_hpetClockEvent.maxDelta = (uint64_t)HPET_MAX_TICKS * NSEC_PER_MSEC / g_hpetKhz;
+
+    hpetWrite(HPET_TIMER_COMPARATOR, hpetRead(HPET_MAIN_COUNTER) - 1);
+    hpetWrite(HPET_TIMER_CONF, conf | HPET_TN_INT_ENABLE);
+    clockEventRegister(&g_hpetClockEvent);
+    return true;
+}
@@ -0,0 +1,20 @@
+#ifndef MAROX_HPET_H
+#define MAROX_HPET_H
+
+#include "marox.h"
+
+/*
+ * High Precision Event Timer, found through the ACPI "HPET" table.
+ * Its main counter is a steady, high-resolution clock (usually
+ * 10-100 MHz), and its first comparator serves as a one-shot timer
+ * event device.
+ */
+
+bool hpetInit(void);
+bool hpetAvailable(void);
+uint64_t hpetCounter(void);
+uint32_t hpetKhz(void);
+uint32_t hpetRouteCap(void);
+bool hpetEventStart(unsigned int gsi);
+
+#endif /* MAROX_HPET_H */
@@ -0,0 +1,163 @@
+#include "int.h"
+#include "clock.h"
+#include "hrtimer.h"
+
+static bool hrtimerLess(rb_node_t* a, rb_node_t* b);
+
+/* pending timers, by latest expiry; protected by disabling interrupts */
+static rb_tree_t g_hrtimers = { NULL, NULL, hrtimerLess };
+
+/* hardware that interrupts when the first timer expires */
+static clock_event_t* g_clockEvent;
+
+/* set while hrtimerInterrupt() runs callbacks, which reprograms the
+ * hardware once they are done rather than after every re-arm */
+static bool g_inInterrupt;
+
+static bool hrtimerLess(rb_node_t* a, rb_node_t* b) {
+    return RB_ENTRY(a, hrtimer_t, node)->latest < RB_ENTRY(b, hrtimer_t, node)->latest;
+}
+
+static inline hrtimer_t* firstTimer(void) {
+    rb_node_t* node = rbFirst(&g_hrtimers);
+    return (node != NULL) ? RB_ENTRY(node, hrtimer_t, node) : NULL;
+}
+
+/*
+ * Program the hardware for the end of the first timer's window, which
+ * is as late as it can wait; any other timers whose window has opened
+ * by then run from the same interrupt. The delay is clamped
+ * to what the hardware can do (a timer too far out for it is reached
+ * over several interrupts).
+ * Called with interrupts disabled.
+ */
+static void reprogram(uint64_t now) {
+    hrtimer_t* first = firstTimer();
+    if (g_clockEvent == NULL || first == NULL) {
+        return;
+    }
+
+    uint64_t delta = (first->latest > now) ? first->latest - now : 0;
+    if (delta < g_clockEvent->minDelta) {
+        delta = g_clockEvent->minDelta;
+    }
+    if (delta > g_clockEvent->maxDelta) {
+        delta = g_clockEvent->maxDelta;
+    }
+    g_clockEvent->setNextEvent(delta);
+}
+
+void hrtimerInit(hrtimer_t* timer, hrtimer_func_t func, void* data) {
+    KASSERT(timer);
+    KASSERT(func);
+    timer->expires = 0;
+    timer->latest = 0;
+    timer->func = func;
+    timer->data = data;
+    timer->pending = false;
+}
+
+/*
+ * (Re-)arm a timer to fire once clockNanos() reaches `expires`.
+ * A time already passed fires as soon as possible.
+ * May be called from interrupt handlers.
+ */
+void hrtimerStart(hrtimer_t* timer, uint64_t expires) {
+    hrtimerStartRange(timer, expires, 0);
+}
+
+/*
+ * (Re-)arm a timer to fire once clockNanos() reaches `expires`, or up
+ * to `slack` nanoseconds later if that lets it share an interrupt
+ * with other timers.
+ * May be called from interrupt handlers.
+ */
+void hrtimerStartRange(hrtimer_t* timer, uint64_t expires, uint64_t slack) {
+    KASSERT(timer);
+
+    bool iFlag = begIntAtomic();
+
+    hrtimerCancel(timer);
+
+    timer->expires = expires;
+    timer->latest = (expires + slack < expires) ? UINT64_MAX : expires + slack;
+    timer->pending = true;
+    /* ordered by latest expiry; ties fire in FIFO order */
+    rbInsert(&g_hrtimers, &timer->node);
+
+    if (!g_inInterrupt && firstTimer() == timer) {
+        reprogram(clockNanos());
+    }
+
+    endIntAtomic(iFlag);
+}
+
+/*
+ * Disarm a timer. The hardware is left as it is; an interrupt for a
+ * cancelled timer finds nothing to do and programs the next one.
+ */
+void hrtimerCancel(hrtimer_t* timer) {
+    KASSERT(timer);
+
+    bool iFlag = begIntAtomic();
+
+    if (timer->pending) {
+        rbRemove(&g_hrtimers, &timer->node);
+        timer->pending = false;
+    }
+
+    endIntAtomic(iFlag);
+}
+
+/*
+ * Run the callbacks of all timers whose window has opened, and program
+ * the hardware for the next one. Timers are visited in order of their
+ * latest expiry, so the first one whose window is still closed ends
+ * the batch. Called from the clock event device's interrupt.
+ */
+void hrtimerInterrupt(void) {
+    KASSERT(!interruptsEnabled());
+
+    g_inInterrupt = true;
+
+    uint64_t now = clockNanos();
+    hrtimer_t* timer;
+    while ((timer = firstTimer()) != NULL) {
+        if (timer->expires > now) {
+            /* callbacks take time too: look again before
+             * concluding the rest is in the future */
+            now = clockNanos();
+            if (timer->expires > now) {
+                break;
+            }
+        }
+
+        rbRemove(&g_hrtimers, &timer->node);
+        timer->pending = false;
+        /* the callback may re-arm the timer */
+        timer->func(timer);
+    }
+
+    g_inInterrupt = false;
+
+    reprogram(clockNanos());
+}
+
+/*
+ * Use a device to drive the timers, from now on. A later device
+ * (e.g. a local APIC timer replacing the PIT) takes over.
+ */
+void clockEventRegister(clock_event_t* dev) {
+    KASSERT(dev);
+    KASSERT(dev->setNextEvent);
+    KASSERT(dev->minDelta > 0 && dev->minDelta <= dev->maxDelta);
+
+    bool iFlag = begIntAtomic();
+
+    g_clockEvent = dev;
+    reprogram(clockNanos());
+
+    endIntAtomic(iFlag);
+
+    kprintf("Timer events: %s\n", dev->name);
+}
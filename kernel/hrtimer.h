@@ -0,0 +1,54 @@
+#ifndef MAROX_HRTIMER_H
+#define MAROX_HRTIMER_H
+
+#include "marox.h"
+#include "rbtree.h"
+
+/*
+ * High-resolution timers: one-shot callbacks at a clockNanos() time.
+ * Instead of being checked every tick, the timer hardware is
+ * programmed to interrupt when the first timer must fire: at the end
+ * of its window (see below), exactly at its expiry if it has no slack.
+ *
+ * A timer may be given slack: it fires at any point between its
+ * expiry and expiry + slack. Timers whose windows overlap are then
+ * run together from a single interrupt, at the end of the earliest
+ * window, rather than each from its own.
+ *
+ * Callbacks run from the timer interrupt, with interrupts disabled,
+ * and may re-arm their own timer.
+ */
+struct hrtimer;
+typedef void (*hrtimer_func_t)(struct hrtimer* timer);
+
+struct hrtimer {
+    uint64_t expires;           /* clockNanos() time, earliest to fire */
+    uint64_t latest;            /* expires + slack */
+    hrtimer_func_t func;
+    void* data;
+    bool pending;
+    rb_node_t node;
+};
+typedef struct hrtimer hrtimer_t;
+
+/*
+ * Timer hardware that can raise one interrupt after a given delay
+ * (the PIT, or a local APIC timer), which must call hrtimerInterrupt().
+ */
+struct clock_event {
+    const char* name;
+    uint64_t minDelta;          /* shortest delay it can be programmed for, ns */
+    uint64_t maxDelta;          /* longest */
+    void (*setNextEvent)(uint64_t delta);
+};
+typedef struct clock_event clock_event_t;
+
+void hrtimerInit(hrtimer_t* timer, hrtimer_func_t func, void* data);
+void hrtimerStart(hrtimer_t* timer, uint64_t expires);
+void hrtimerStartRange(hrtimer_t* timer, uint64_t expires, uint64_t slack);
+void hrtimerCancel(hrtimer_t* timer);
+void hrtimerInterrupt(void);
+
+void clockEventRegister(clock_event_t* dev);
+
+#endif /* MAROX_HRTIMER_H */
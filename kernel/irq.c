@@ -3,6 +3,7 @@
 #include "idt.h"
 #include "x86.h"
 #include "irq.h"
+#include "apic.h"
 
 
 enum { IRQ_NUM_HANDLERS = 16 };
@@ -45,7 +46,20 @@ static int_handler_t g_isrs[IRQ_NUM_HANDLERS];
 // static copy of the IRQ mask from MASTER/SLAVE PIC data ports
 static uint16_t g_irq_mask;
 
+// IRQs are routed through the I/O APIC instead of the PICs
+static bool g_useIoApic;
+
 static void updateIrqMask(uint16_t mask) {
+    if (g_useIoApic) {
+        for (unsigned int irq = 0; irq < IRQ_NUM_HANDLERS; ++irq) {
+            if (((mask ^ g_irq_mask) >> irq) & 1) {
+                ioapicSetMasked(irq, (mask >> irq) & 1);
+            }
+        }
+        g_irq_mask = mask;
+        return;
+    }
+
     // if the lower 8-bits don't match, update the MASTER port
     if ((mask & 0xFF) != (g_irq_mask & 0xFF)) {
         outPortB(MASTER_PIC_DATA, mask & 0xFF);
@@ -133,6 +147,23 @@ void irqInit(void) {
     idtSetIntGate(IRQ_ISR_START + 15, (uintptr_t)irq15, KERNEL_DPL);
 }
 
+/*
+ * Hand IRQ delivery over to the I/O APIC (see apicInit()): the PICs
+ * are masked for good, and the IRQs enabled so far are unmasked at
+ * the I/O APIC. Called with interrupts disabled.
+ */
+void irqUseIoApic(void) {
+    KASSERT(!interruptsEnabled());
+
+    for (unsigned int irq = 0; irq < IRQ_NUM_HANDLERS; ++irq) {
+        ioapicSetMasked(irq, (g_irq_mask >> irq) & 1);
+    }
+
+    outPortB(MASTER_PIC_DATA, 0xFF);
+    outPortB(SLAVE_PIC_DATA, 0xFF);
+    g_useIoApic = true;
+}
+
 void initIrqHandler(unsigned int irq, int_handler_t handler) {
     KASSERT(irq < IRQ_NUM_HANDLERS);
     g_isrs[irq] = handler;
@@ -154,6 +185,11 @@ void baseIrqHandler(struct regs *r) {
         handler(r);
     }
 
+    if (g_useIoApic) {
+        lapicEoi();
+        return;
+    }
+
     /* if the IDT entry invoked is greater than 40
      * (meaning IRQ8-15), then send 'End of Interrupt' to
      * slave interrupt controller */
@@ -15,5 +15,6 @@ void initIrqHandler(unsigned int irq, int_handler_t handler);
 void enableIrq(unsigned int irq);
 void disableIrq(unsigned int irq);
 bool irqEnabled(unsigned int irq);
+void irqUseIoApic(void);
 
 #endif /* MAROX_IRQ_H */
@@ -1,15 +1,22 @@
 #include "irq.h"
 #include "io.h"
+#include "int.h"
 #include "thread.h"
 #include "kb.h"
 #include "print.h"
+#include "ring.h"
 
 static thread_queue_t keycodeWaitQueue;
 
-enum { KEYCODE_QUEUE_MASK = 255, KEYCODE_QUEUE_SIZE = 256 };
-//#define KEYCODE_QUEUE_NEXT(idx)     (((idx) + 1) & KEYCODE_QUEUE_MASK)
-static keycode_t keycodeQueue[KEYCODE_QUEUE_SIZE];
-static uint8_t keycodeQueueHead, keycodeQueueTail;
+/*
+ * Key codes go from the interrupt handler (the only producer) to
+ * threads through a lock-free ring, so neither side has to disable
+ * interrupts to move them. Consumers only need to be serialized
+ * among themselves, which disabling preemption does.
+ */
+enum { KEYCODE_QUEUE_SIZE = 256 };
+static keycode_t keycodeStorage[KEYCODE_QUEUE_SIZE];
+static spsc_ring_t keycodeQueue;
 
 /* US Keyboard Layout lookup table */
 uint8_t kdbus[] = {
@@ -51,17 +58,15 @@ uint8_t kdbus[] = {
     0,  /* All other keys are undefined */
 };
 
-static void enqueueKeycode(keycode_t kc) {
-    /* only enqueue key code if the queue is not full */
-    if ((keycodeQueueTail + 1) != keycodeQueueHead) {
-        keycodeQueue[keycodeQueueTail++] = kc;
-    }
-}
-
-static keycode_t dequeueKeycode(void) {
-    /* assert that the queue is not empty */
-    KASSERT(keycodeQueueHead != keycodeQueueTail);
-    return keycodeQueue[keycodeQueueHead++];
+/*
+ * Take a key code from the queue, if there is one.
+ * Safe with interrupts enabled.
+ */
+static bool takeKeycode(keycode_t* kc) {
+    disablePreemption();
+    bool taken = spscDequeue(&keycodeQueue, kc, 1) == 1;
+    enablePreemption();
+    return taken;
 }
 
 static void toggleLight(unsigned int lightCode) {
@@ -98,57 +103,108 @@ void keyboardHandler(struct regs *r) {
             toggleCapsLockLight();
         }
     } else {
-        /* key pressed, add it to keycode queue and wake up
-         * all threads waiting on the keycode thread queue */
-        uint16_t keycode = kdbus[scancode];
-        enqueueKeycode(keycode);
+        /* key pressed, add it to keycode queue (dropped if full)
+         * and wake up one thread to take it (tasks are always woken) */
+        keycode_t keycode = kdbus[scancode];
+        spscEnqueue(&keycodeQueue, &keycode, 1);
 
-        wakeAll(&keycodeWaitQueue);
+        wakeUp(&keycodeWaitQueue, 1);
     }
 }
 
 /* installs keyboardHandler into IRQ1 */
 void keyboardInit() {
+    spscInit(&keycodeQueue, keycodeStorage, sizeof(keycode_t), KEYCODE_QUEUE_SIZE);
+    threadQueueInitPriority(&keycodeWaitQueue);
     initIrqHandler(IRQ_KEYBOARD, keyboardHandler);
     enableIrq(IRQ_KEYBOARD);
 }
 
+/*
+ * Wait until a key code can be taken. Interrupts only need to be
+ * disabled around the final check before waiting, so that a key
+ * arriving in between cannot be missed.
+ */
+static void waitKeycodeQueue(void) {
+    bool iFlag = begIntAtomic();
+    if (spscEmpty(&keycodeQueue)) {
+        waitExclusive(&keycodeWaitQueue);
+    }
+    endIntAtomic(iFlag);
+}
+
 keycode_t waitForKey(void) {
     keycode_t kc;
-    bool iFlag = begIntAtomic();
-    bool empty = true;
 
-    do {
-        empty = (keycodeQueueHead == keycodeQueueTail);
+    while (!takeKeycode(&kc)) {
+        waitKeycodeQueue();
+    }
 
-        if (empty) {
-            wait(&keycodeWaitQueue);
-        } else {
-            kc = dequeueKeycode();
+    return kc;
+}
+
+/*
+ * Wait for a key for at most the given number of milliseconds.
+ *
+ * @returns false if no key arrived in time
+ */
+bool waitForKeyTimeout(keycode_t* kc, unsigned int milliseconds) {
+    KASSERT(kc);
+
+    uint32_t deadline = getTicks() + msecsToTicks(milliseconds);
+
+    while (!takeKeycode(kc)) {
+        uint32_t left = ticksUntil(deadline);
+        if (left == 0) {
+            return false;
         }
-    } while (empty);
 
-    endIntAtomic(iFlag);
+        bool iFlag = begIntAtomic();
+        if (spscEmpty(&keycodeQueue)) {
+            waitExclusiveTimeout(&keycodeWaitQueue, left);
+        }
+        endIntAtomic(iFlag);
+    }
 
-    return kc;
+    return true;
 }
 
-int getLine(char* buff) {
-    keycode_t kc;
+/*
+ * Take a key from the keycode queue without blocking.
+ *
+ * @returns false if no key is available
+ */
+bool pollKey(keycode_t* kc) {
+    KASSERT(kc);
+    return takeKeycode(kc);
+}
+
+/*
+ * Resume a task once a key is available (immediately if one already is).
+ */
+void taskWaitForKey(task_t* task) {
+    KASSERT(task);
     bool iFlag = begIntAtomic();
-    bool empty = true;
+
+    if (!spscEmpty(&keycodeQueue)) {
+        taskWake(task);
+    } else {
+        taskWaitOn(task, &keycodeWaitQueue);
+    }
+
+    endIntAtomic(iFlag);
+}
+
+int getLine(char* buff) {
+    keycode_t kc = 0;
 
     int i = 0;
     do {
-        empty = (keycodeQueueHead == keycodeQueueTail);
-
-        if (empty) {
-            wait(&keycodeWaitQueue);
+        if (!takeKeycode(&kc)) {
+            waitKeycodeQueue();
         } else {
             bool shouldPrintChar = false;
 
-            kc = dequeueKeycode();
-
             // DEBUGF("i before key press: %d\n", i);
 
             if (kc != 0) {
@@ -172,7 +228,5 @@ int getLine(char* buff) {
         }
     } while (kc != '\n');
 
-    endIntAtomic(iFlag);
-
     return i-1;
 }
\ No newline at end of file
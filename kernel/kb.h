@@ -1,6 +1,8 @@
 #ifndef MAROX_KB_H
 #define MAROX_KB_H
 
+#include "task.h"
+
 enum {
     KBD_STATUS_BUSY = 0x02,
     KBD_DATA_REG = 0x60,
@@ -13,6 +15,10 @@ void keyboardInit();
 
 typedef uint16_t keycode_t;
 keycode_t waitForKey(void);
+bool waitForKeyTimeout(keycode_t* kc, unsigned int milliseconds);
 int getLine(char*);
 
+bool pollKey(keycode_t* kc);
+void taskWaitForKey(task_t* task);
+
 #endif /* MAROX_KB_H */
@@ -11,18 +11,27 @@
 #include "kb.h"
 #include "rtc.h"
 #include "timer.h"
+#include "clock.h"
+#include "acpi.h"
+#include "hpet.h"
+#include "apic.h"
+#include "workqueue.h"
+#include "task.h"
 
 extern uintptr_t g_start, g_code, g_data, g_bss, g_end;
 
 static void testShmSend(uint32_t);
 static void testShmRead(uint32_t);
 static void printDate(uint32_t);
-static void echoInput(uint32_t);
+static task_status_t echoInput(task_t*);
 static void hogCPU(uint32_t);
 static void testUsermode(uint32_t);
-static void echoRegisterValues(uint32_t);
+static task_status_t echoRegisterValues(task_t*);
 static void isPrime(uint32_t);
 static void godThread(uint32_t);
+#ifdef MAROX_BENCH
+static void benchContextSwitch(void);
+#endif
 
 struct modInfo {
     uintptr_t start;
@@ -86,9 +95,28 @@ void kMain(struct multiboot_info *mbInfo, multiboot_uint32_t mbootMagic) {
     schedulerInit();
     kprintf("Scheduler initialized\n");
 
+    workqueueInit();
+    kprintf("Work queues initialized\n");
+
+    tasksInit();
+    kprintf("Task executor started\n");
+
+#ifdef MAROX_BENCH
+    benchContextSwitch();
+#endif
+
     pagingInit();
     kprintf("Paging enabled\n");
 
+    if (acpiInit()) {
+        hpetInit();
+    }
+    clockInit();
+
+    if (!apicInit()) {
+        kprintf("Using the 8259 PICs for interrupts\n");
+    }
+
     DEBUGF("ESP: %X\n", getESP());
 
     // Run GRUB module (which just returns the value of register ESP
@@ -108,17 +136,41 @@ void kMain(struct multiboot_info *mbInfo, multiboot_uint32_t mbootMagic) {
     kprintf("page fault? %u\n", *page_fault); */
 
     // test threads - loop infinitely without yielding CPU */
-    // thread_t *infinite0 = spawnThread(hogCPU, 0, PRIORITY_NORMAL, false, false);
-    // thread_t *infinite1 = spawnThread(hogCPU, 0, PRIORITY_NORMAL, false, false);
-    thread_t *infinite2 = spawnThread(echoRegisterValues, 0, PRIORITY_NORMAL, false, false);
+    // as a batch group they get at most 20 ms of CPU every 100 ms,
+    // however many of them there are
+    static sched_group_t batchGroup;
+    schedGroupInit(&batchGroup, "batch", FAIR_WEIGHT_DEFAULT);
+    schedGroupSetQuota(&batchGroup, 20, 100);
+    thread_t *infinite0 = spawnThread(hogCPU, 0, PRIORITY_NORMAL, false, false);
+    setSchedGroup(infinite0, &batchGroup);
+    setSchedPolicy(infinite0, SCHED_FAIR);
+    thread_t *infinite1 = spawnThread(hogCPU, 0, PRIORITY_NORMAL, false, false);
+    setSchedGroup(infinite1, &batchGroup);
+    setSchedPolicy(infinite1, SCHED_FAIR);
+    taskSpawn(echoRegisterValues, NULL);
 
     // start thread to print date/time on screen
     thread_t* datePrinter = spawnThread(printDate, 0, PRIORITY_NORMAL, false, false);
+    // refresh the clock every 200 ms, on time even when the CPU is busy
+    if (!setSchedDeadline(datePrinter, 10, 50, 200)) {
+        kprintf("Failed to admit date printer as deadline thread\n");
+        // then it sleep()s instead; a late redraw goes unnoticed
+        setTimerSlack(datePrinter, 20 * NSEC_PER_MSEC);
+    }
+    // module threads share the CPU fairly per group (tenant), not per thread
+    static sched_group_t moduleGroup;
+    schedGroupInit(&moduleGroup, "modules", FAIR_WEIGHT_DEFAULT);
     thread_t* tst = spawnThread(mod0, 0, PRIORITY_NORMAL, false, false);
+    setSchedGroup(tst, &moduleGroup);
+    setSchedPolicy(tst, SCHED_FAIR);
     // thread_t* test = spawnThread(testUsermode, 5, PRIORITY_NORMAL, false, true);
 
     thread_t* shm_send = spawnThread(testShmSend, 0, PRIORITY_NORMAL, false, false);
+    setSchedPolicy(shm_send, SCHED_MLFQ);
+    // its half-second sleeps can end a little late, sharing a wakeup
+    setTimerSlack(shm_send, 10 * NSEC_PER_MSEC);
     thread_t* shm_recv = spawnThread(testShmRead, 0, PRIORITY_NORMAL, false, false);
+    setSchedPolicy(shm_recv, SCHED_MLFQ);
 
     // wait for some thread to finish (forever)
     join(datePrinter);
@@ -132,20 +184,18 @@ void kMain(struct multiboot_info *mbInfo, multiboot_uint32_t mbootMagic) {
     kprintf("Goodbye!");
 }
 
-static void echoRegisterValues(uint32_t arg) {
-    (void)arg;
+static task_status_t echoRegisterValues(task_t* task) {
     static volatile uint32_t eaxValue, ebxValue, ecxValue, edxValue;
 
-    while (true) {
-        __asm__ ("mov %%EAX, %0": "=r" (eaxValue));
-        __asm__ ("mov %%EBX, %0": "=r" (ebxValue));
-        __asm__ ("mov %%ECX, %0": "=r" (ecxValue));
-        __asm__ ("mov %%EDX, %0": "=r" (edxValue));
+    __asm__ ("mov %%EAX, %0": "=r" (eaxValue));
+    __asm__ ("mov %%EBX, %0": "=r" (ebxValue));
+    __asm__ ("mov %%ECX, %0": "=r" (ecxValue));
+    __asm__ ("mov %%EDX, %0": "=r" (edxValue));
 
-        DEBUGF("[EAX=%x; EBX=%x; ECX=%x; EDX=%x]\n", eaxValue, ebxValue, ecxValue, edxValue);
+    DEBUGF("[EAX=%x; EBX=%x; ECX=%x; EDX=%x]\n", eaxValue, ebxValue, ecxValue, edxValue);
 
-        sleep(2000);
-    }
+    taskSleep(task, 2000);
+    return TASK_BLOCKED;
 }
 
 static void printDate(uint32_t arg) {
@@ -159,24 +209,35 @@ static void printDate(uint32_t arg) {
         kSetCursor(arg, 58);
         kprintf("%02u:%02u:%02u %s %02u, %04u", dt.hour, dt.min, dt.sec, monthName(dt.month), dt.mday, dt.year);
         kSetCursor(row, col);
-        sleep(200);
+        if (getCurrentThread()->policy == SCHED_DEADLINE) {
+            waitNextPeriod();
+        } else {
+            sleep(200);
+        }
     }
 }
 
-void echoInput(uint32_t arg) {
-    (void)arg;
+/* echo up to (uintptr_t)task->data keys; task->state counts them */
+static task_status_t echoInput(task_t* task) {
+    unsigned int limit = (uintptr_t)task->data;
+    keycode_t kc;
 
-    for (unsigned int i = 0; i < arg; ++i) {
-        keycode_t kc = waitForKey();
+    while (task->state < limit) {
+        if (!pollKey(&kc)) {
+            taskWaitForKey(task);
+            return TASK_BLOCKED;
+        }
 
         if (kc == 'q') {
             break;
         }
 
         kPutChar(kc);
+        ++task->state;
     }
 
     kprintf("\nYou've typed enough!\n");
+    return TASK_DONE;
 }
 
 static void hogCPU(uint32_t arg) {
@@ -236,17 +297,20 @@ static void testShmRead(uint32_t arg) {
     char buff[11];
     int num;
 
+    /* prime checks run on the shared worker pool, two at a time */
+    workqueue_t* primeQueue = workqueueCreate("primes", 2);
+    KASSERT(primeQueue);
+
     while (true) {
         shmRead(arg, buff);
         num = atoi(buff);
         kprintf("Recv thread got: %d\nStarting prime check:\n", num);
-        
-        thread_t* list[num];
 
         for (int i = 1; i <= num; ++i) {
-            list[i] = spawnThread(isPrime, i, PRIORITY_NORMAL, false, false);
-            sleep(500);
+            workqueueSubmit(primeQueue, isPrime, i);
         }
+
+        workqueueFlush(primeQueue);
     }
 }
 
@@ -259,5 +323,72 @@ static void isPrime(uint32_t arg) {
     }
 
     kprintf("[Thread %d] %d is a prime.\n", getCurrentThread()->id, arg);
-    exit(0);
-}
\ No newline at end of file
+}
+
+#ifdef MAROX_BENCH
+enum { BENCH_ROUNDS = 10000 };
+
+/* in start.s, built with MAROX_BENCH */
+extern void switchToThread(thread_t*);
+extern void switchToThreadFull(thread_t*);
+extern void switchToThreadOld(thread_t*);
+
+typedef void (*switch_func_t)(thread_t*);
+
+/* cycles per call of a switch routine, switching to the running thread */
+static uint32_t benchSwitchRoutine(switch_func_t switchFunc) {
+    thread_t* current = getCurrentThread();
+
+    bool iFlag = begIntAtomic();
+    uint64_t start = readTsc();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        switchFunc(current);
+    }
+    uint32_t cycles = (uint32_t)((readTsc() - start) / BENCH_ROUNDS);
+    endIntAtomic(iFlag);
+
+    return cycles;
+}
+
+static void benchYielder(uint32_t arg) {
+    for (uint32_t i = 0; i < arg; ++i) {
+        yield();
+    }
+}
+
+/*
+ * Measure the cost of a context switch in CPU cycles:
+ * the switch routine before and after it was slimmed down (old: all
+ * registers and a setKernelStack() call; new: callee-saved registers
+ * only, and nothing at all when switching to the running thread),
+ * then through the scheduler: yielding with nothing else to run, and
+ * two threads of equal priority yielding to each other.
+ */
+static void benchContextSwitch(void) {
+    uint32_t oldCycles = benchSwitchRoutine(switchToThreadOld);
+    uint32_t fullCycles = benchSwitchRoutine(switchToThreadFull);
+    uint32_t skipCycles = benchSwitchRoutine(switchToThread);
+    kprintf("Switch routine: old %u cycles, new %u cycles (%u to the running thread)\n",
+            oldCycles, fullCycles, skipCycles);
+
+    uint64_t start = readTsc();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        yield();
+    }
+    uint32_t selfCycles = (uint32_t)((readTsc() - start) / BENCH_ROUNDS);
+
+    thread_t* partner = spawnThread(benchYielder, BENCH_ROUNDS, getCurrentThread()->priority, false, false);
+    KASSERT(partner);
+
+    start = readTsc();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        yield();
+    }
+    /* every round switches to the partner and back */
+    uint32_t pingPongCycles = (uint32_t)((readTsc() - start) / (2 * BENCH_ROUNDS));
+    join(partner);
+
+    kprintf("Context switch: yield to self %u cycles, to other thread %u cycles\n",
+            selfCycles, pingPongCycles);
+}
+#endif
@@ -3,6 +3,8 @@
 #include "string.h"
 #include "mem.h"
 #include "thread.h"
+#include "sync.h"
+#include "ring.h"
 
 static page_t* g_pageArray = NULL;
 
@@ -10,8 +12,17 @@ static page_t* g_freePageHead = NULL;
 static page_t* g_freePageTail = NULL;
 static unsigned int g_freePageCount;
 static shm_t sharedMemory[100];
-static mutex_t shmLock;
-static thread_queue_t shmWaitQueue;
+/* guards the owners in sharedMemory (looked up far more than changed) */
+static rwlock_t shmLock;
+/*
+ * Each buffer carries a stream of messages from its owner to readers,
+ * through a lock-free ring over the buffer itself. A message is its
+ * length followed by that many bytes of string (NUL included).
+ */
+enum { SHM_SIZE = 0x1000 };
+static spsc_ring_t shmRing[100];
+/* counts the messages in each ring not yet picked up by a reader */
+static semaphore_t shmMessages[100];
 
 /*
  * Determine if given address is a multiple of the page size.
@@ -122,6 +133,8 @@ static void markPageRange(uintptr_t start, uintptr_t end, uint32_t flags) {
         } else {
             page->next = NULL;
         }
+
+        condResched();
     }
 }
 
@@ -238,60 +251,129 @@ void bssInit(void) {
 }
 
 void shmInit(void) {
+    rwlockInit(&shmLock);
+
     for (int i = 0; i < 100; ++i) {
         sharedMemory[i].owner = 0;
-        sharedMemory[i].buffer = (uintptr_t)bgetz(0x1000);
+        sharedMemory[i].buffer = (uintptr_t)bgetz(SHM_SIZE);
+        spscInit(&shmRing[i], (void*)sharedMemory[i].buffer, 1, SHM_SIZE);
+        semInit(&shmMessages[i], 0);
     }
 }
 
+/*
+ * @returns the descriptor of a free shared memory buffer, now owned
+ *          by the current thread, or -1 if there is none
+ */
 int shmGet() {
-    unsigned int i = 0;
-    while (1) {
+    int desc = -1;
+
+    writeLock(&shmLock);
+    for (int i = 0; i < 100; ++i) {
         if (sharedMemory[i].owner == 0) {
             sharedMemory[i].owner = getCurrentThread()->id;
-            return i;
+            desc = i;
+            break;
         }
-
-    	mutexLock(&shmLock);
-        ++i;
-    	mutex_unlock(&shmLock);
     }
+    writeUnlock(&shmLock);
+
+    return desc;
 }
 
 int shmRelease(int id) {
-    if (sharedMemory[id].owner == getCurrentThread()->id) {
+    int result = -1;
+
+    writeLock(&shmLock);
+    if (id >= 0 && id < 100 && sharedMemory[id].owner == getCurrentThread()->id) {
         sharedMemory[id].owner = 0;
-        memset((void*)sharedMemory[id].buffer, 0, 0x1000);
-    } else {
-        return -1;
+        /* drop unread messages */
+        while (semTryDown(&shmMessages[id])) ;
+        memset((void*)sharedMemory[id].buffer, 0, SHM_SIZE);
+        spscInit(&shmRing[id], (void*)sharedMemory[id].buffer, 1, SHM_SIZE);
+        result = 0;
     }
+    writeUnlock(&shmLock);
 
-    return 0;
+    return result;
 }
 
+/*
+ * Send a string to the readers of a buffer the current thread owns.
+ * The owner is the ring's only producer, so no lock is needed to
+ * append; the message goes in whole or not at all.
+ *
+ * @returns -1 if not the owner, the message can never fit in the
+ * buffer, or there is no room for it right now
+ */
 int shmWrite(int desc, char* buffer) {
-    if (sharedMemory[desc].owner == getCurrentThread()->id) {
-        strcpy((char*)sharedMemory[desc].buffer, buffer);
-    } else {
+    size_t size = strlen(buffer) + 1;
+    if (size > SHM_SIZE - sizeof(uint16_t)) {
         return -1;
     }
-    bool iFlag = begIntAtomic();
-    wakeOne(&shmWaitQueue);
-    endIntAtomic(iFlag);
+    uint16_t len = size;
+
+    readLock(&shmLock);
+    bool sent = desc >= 0 && desc < 100 &&
+            sharedMemory[desc].owner == getCurrentThread()->id &&
+            spscFree(&shmRing[desc]) >= sizeof(len) + len;
+    if (sent) {
+        spscEnqueue(&shmRing[desc], &len, sizeof(len));
+        spscEnqueue(&shmRing[desc], buffer, len);
+    }
+    readUnlock(&shmLock);
+
+    if (!sent) {
+        return -1;
+    }
+    thread_t* reader = semUp(&shmMessages[desc]);
+
+    /* hand the CPU straight to the reader, instead of letting it wait
+     * behind every other runnable thread */
+    if (reader != NULL) {
+        yieldTo(reader);
+    }
     return 0;
 }
 
+/* copy out a message whose arrival has been counted down */
+static int shmTake(int desc, char* buffer) {
+    /* readers of one buffer take turns as the ring's consumer */
+    uint16_t len = 0;
+    readLock(&shmLock);
+    disablePreemption();
+    spscDequeue(&shmRing[desc], &len, sizeof(len));
+    unsigned int got = spscDequeue(&shmRing[desc], buffer, len);
+    enablePreemption();
+    readUnlock(&shmLock);
+
+    return (len > 0 && got == len) ? 0 : -1;
+}
+
+/*
+ * Wait for the next message on a buffer and copy it out.
+ */
 int shmRead(int desc, char* buffer) {
-    bool iFlag = begIntAtomic();
-    wait(&shmWaitQueue);
-    endIntAtomic(iFlag);
-    if (desc >= 0 && desc < 10) {
-        strcpy(buffer, (const char*)sharedMemory[desc].buffer);
-    } else {
+    if (desc < 0 || desc >= 100) {
         return -1;
     }
-    
-    return 0;
+    semDown(&shmMessages[desc]);
+    return shmTake(desc, buffer);
+}
+
+/*
+ * Like shmRead(), but give up after the given number of milliseconds.
+ *
+ * @returns -1 if no message arrived in time
+ */
+int shmReadTimeout(int desc, char* buffer, unsigned int milliseconds) {
+    if (desc < 0 || desc >= 100) {
+        return -1;
+    }
+    if (!semDownTimeout(&shmMessages[desc], milliseconds)) {
+        return -1;
+    }
+    return shmTake(desc, buffer);
 }
 
 void* malloc(size_t size) {
@@ -48,6 +48,7 @@ int shmGet();
 int shmRelease(int);
 int shmWrite(int, char*);
 int shmRead(int, char*);
+int shmReadTimeout(int, char*, unsigned int);
 
 uintptr_t pageAlignUp(uintptr_t addr);
 uintptr_t pageAlignDown(uintptr_t addr);
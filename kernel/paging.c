@@ -2,6 +2,27 @@
 #include "x86.h"
 #include "paging.h"
 #include "idt.h"
+#include "string.h"
+
+enum {
+    PAGE_PRESENT = 0x1,
+    PAGE_WRITE = 0x2,
+    PAGE_USER = 0x4,
+    PAGE_WRITETHROUGH = 0x8,
+    PAGE_NOCACHE = 0x10,
+
+    KERNEL_MAPPED_SIZE = 16 * 1024 * 1024,  /* mapped at KERNEL_VBASE */
+
+    /* virtual addresses handed out by mapPages() */
+    MAP_WINDOW_BASE = 0xE0000000,
+    MAP_WINDOW_END = 0xF0000000
+};
+
+/* page directory set up by pagingInit(), as a kernel virtual address */
+static uint32_t* g_pageDirectory;
+
+/* next free address in the mapping window */
+static uintptr_t g_mapNext = MAP_WINDOW_BASE;
 
 uintptr_t physToVirt(uintptr_t phys) {
     return phys + KERNEL_VBASE;
@@ -62,6 +83,8 @@ void pagingInit(void) {
         DEBUGF("page table %u: 0x%x\n", pidx, virtToPhys(pageTable));
     }
 
+    g_pageDirectory = (uint32_t*)pageDirectory;
+
     installIntHandler(14, pageFaultHandler);
 
     /* move PHYSICAL page directory address into cr3 */
@@ -96,3 +119,92 @@ void pagingInit(void) {
     }
     */
 }
+
+/*
+ * Map a physical range into the kernel's mapping window.
+ * Mappings are permanent: they are meant for firmware tables and
+ * device registers found at boot.
+ *
+ * @returns the virtual address of `phys`
+ */
+static void* mapPages(uintptr_t phys, size_t size, uint32_t flags) {
+    KASSERT(g_pageDirectory);
+    KASSERT(size > 0);
+
+    uintptr_t start = phys & ~0xFFF;
+    uintptr_t end = (phys + size + 0xFFF) & ~0xFFF;
+    KASSERT(end - start <= MAP_WINDOW_END - g_mapNext);
+
+    uintptr_t virt = g_mapNext;
+    void* mapped = (void*)(virt + (phys - start));
+    g_mapNext += end - start;
+
+    for (uintptr_t addr = start; addr != end; addr += 0x1000, virt += 0x1000) {
+        uint32_t* pde = &g_pageDirectory[virt >> 22];
+        if (!(*pde & PAGE_PRESENT)) {
+            void* pageTable = allocPage();
+            KASSERT(pageTable);
+            memset(pageTable, 0, 0x1000);
+            *pde = virtToPhys((uintptr_t)pageTable) | PAGE_WRITE | PAGE_PRESENT;
+        }
+
+        uint32_t* pageTable = (uint32_t*)physToVirt(*pde & ~0xFFF);
+        pageTable[(virt >> 12) & 0x3FF] = addr | flags | PAGE_WRITE | PAGE_PRESENT;
+        invlpg(virt);
+    }
+
+    return mapped;
+}
+
+/*
+ * Map device registers (memory-mapped I/O), uncached.
+ * Must be called after pagingInit().
+ */
+void* mapMmio(uintptr_t phys, size_t size) {
+    return mapPages(phys, size, PAGE_NOCACHE | PAGE_WRITETHROUGH);
+}
+
+/*
+ * Access physical memory outside of the kernel's own mapping
+ * (e.g. firmware tables). Must be called after pagingInit().
+ */
+void* mapPhysical(uintptr_t phys, size_t size) {
+    if (phys + size <= KERNEL_MAPPED_SIZE) {
+        return (void*)physToVirt(phys);
+    }
+    return mapPages(phys, size, 0);
+}
+
+/*
+ * Can user mode access [addr, addr + size)? Pointers passed in by
+ * system calls must be checked before the kernel dereferences them.
+ *
+ * User threads' heap and stacks live in the user-accessible part of the
+ * kernel mapping, so that part is allowed, except for the low megabyte
+ * and the kernel image below g_end. Unmapped and supervisor-only pages
+ * (e.g. the mapping window) are rejected.
+ */
+bool userAccessible(const volatile void* addr, size_t size) {
+    extern char g_end;
+    uintptr_t start = (uintptr_t)addr;
+
+    if (g_pageDirectory == NULL || size == 0 || start + size < start ||
+            start < (uintptr_t)&g_end) {
+        return false;
+    }
+
+    for (uintptr_t page = start & ~0xFFF; page < start + size; page += 0x1000) {
+        uint32_t pde = g_pageDirectory[page >> 22];
+        if ((pde & (PAGE_PRESENT | PAGE_USER)) != (PAGE_PRESENT | PAGE_USER)) {
+            return false;
+        }
+
+        uint32_t* pageTable = (uint32_t*)physToVirt(pde & ~0xFFF);
+        uint32_t pte = pageTable[(page >> 12) & 0x3FF];
+        if ((pte & (PAGE_PRESENT | PAGE_USER)) != (PAGE_PRESENT | PAGE_USER)) {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -4,6 +4,9 @@
 #include "marox.h"
 
 void pagingInit(void);
+void* mapMmio(uintptr_t phys, size_t size);
+void* mapPhysical(uintptr_t phys, size_t size);
+bool userAccessible(const volatile void* addr, size_t size);
 
 uintptr_t physToVirt(uintptr_t phys);
 uintptr_t virtToPhys(uintptr_t virt);
@@ -0,0 +1,293 @@
+#include "rbtree.h"
+
+/*
+ * Red-black tree with NULL leaves, following Cormen et al.,
+ * "Introduction to Algorithms", chapter 13.
+ */
+
+void rbInit(rb_tree_t* tree, rb_less_t less) {
+    KASSERT(tree);
+    KASSERT(less);
+    tree->root = NULL;
+    tree->leftmost = NULL;
+    tree->less = less;
+}
+
+static void rotateLeft(rb_tree_t* tree, rb_node_t* x) {
+    rb_node_t* y = x->right;
+
+    x->right = y->left;
+    if (y->left != NULL) {
+        y->left->parent = x;
+    }
+
+    y->parent = x->parent;
+    if (x->parent == NULL) {
+        tree->root = y;
+    } else if (x == x->parent->left) {
+        x->parent->left = y;
+    } else {
+        x->parent->right = y;
+    }
+
+    y->left = x;
+    x->parent = y;
+}
+
+static void rotateRight(rb_tree_t* tree, rb_node_t* x) {
+    rb_node_t* y = x->left;
+
+    x->left = y->right;
+    if (y->right != NULL) {
+        y->right->parent = x;
+    }
+
+    y->parent = x->parent;
+    if (x->parent == NULL) {
+        tree->root = y;
+    } else if (x == x->parent->right) {
+        x->parent->right = y;
+    } else {
+        x->parent->left = y;
+    }
+
+    y->right = x;
+    x->parent = y;
+}
+
+static inline bool isRed(rb_node_t* node) {
+    return node != NULL && node->red;
+}
+
+static void insertFixup(rb_tree_t* tree, rb_node_t* z) {
+    while (isRed(z->parent)) {
+        /* a red parent is never the root, so the grandparent exists */
+        rb_node_t* grandparent = z->parent->parent;
+
+        if (z->parent == grandparent->left) {
+            rb_node_t* uncle = grandparent->right;
+            if (isRed(uncle)) {
+                z->parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                z = grandparent;
+            } else {
+                if (z == z->parent->right) {
+                    z = z->parent;
+                    rotateLeft(tree, z);
+                }
+                z->parent->red = false;
+                z->parent->parent->red = true;
+                rotateRight(tree, z->parent->parent);
+            }
+        } else {
+            rb_node_t* uncle = grandparent->left;
+            if (isRed(uncle)) {
+                z->parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                z = grandparent;
+            } else {
+                if (z == z->parent->left) {
+                    z = z->parent;
+                    rotateRight(tree, z);
+                }
+                z->parent->red = false;
+                z->parent->parent->red = true;
+                rotateLeft(tree, z->parent->parent);
+            }
+        }
+    }
+
+    tree->root->red = false;
+}
+
+/*
+ * Insert a node. Nodes that compare equal are kept in insertion order.
+ */
+void rbInsert(rb_tree_t* tree, rb_node_t* node) {
+    KASSERT(tree);
+    KASSERT(node);
+
+    rb_node_t* parent = NULL;
+    rb_node_t** link = &tree->root;
+    bool leftmost = true;
+
+    while (*link != NULL) {
+        parent = *link;
+        if (tree->less(node, parent)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = true;
+    *link = node;
+
+    if (leftmost) {
+        tree->leftmost = node;
+    }
+
+    insertFixup(tree, node);
+}
+
+static rb_node_t* minimum(rb_node_t* node) {
+    while (node->left != NULL) {
+        node = node->left;
+    }
+    return node;
+}
+
+/*
+ * In-order successor of a node, or NULL
+ */
+rb_node_t* rbNext(rb_node_t* node) {
+    KASSERT(node);
+
+    if (node->right != NULL) {
+        return minimum(node->right);
+    }
+
+    rb_node_t* parent = node->parent;
+    while (parent != NULL && node == parent->right) {
+        node = parent;
+        parent = parent->parent;
+    }
+    return parent;
+}
+
+/* replace the subtree rooted at u with the one rooted at v */
+static void transplant(rb_tree_t* tree, rb_node_t* u, rb_node_t* v) {
+    if (u->parent == NULL) {
+        tree->root = v;
+    } else if (u == u->parent->left) {
+        u->parent->left = v;
+    } else {
+        u->parent->right = v;
+    }
+
+    if (v != NULL) {
+        v->parent = u->parent;
+    }
+}
+
+/*
+ * Restore the red-black properties after removing a black node.
+ * x may be NULL, so its parent is passed separately.
+ */
+static void removeFixup(rb_tree_t* tree, rb_node_t* x, rb_node_t* parent) {
+    while (x != tree->root && !isRed(x)) {
+        if (x == parent->left) {
+            rb_node_t* sibling = parent->right;
+            if (isRed(sibling)) {
+                sibling->red = false;
+                parent->red = true;
+                rotateLeft(tree, parent);
+                sibling = parent->right;
+            }
+            if (!isRed(sibling->left) && !isRed(sibling->right)) {
+                sibling->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!isRed(sibling->right)) {
+                    sibling->left->red = false;
+                    sibling->red = true;
+                    rotateRight(tree, sibling);
+                    sibling = parent->right;
+                }
+                sibling->red = parent->red;
+                parent->red = false;
+                sibling->right->red = false;
+                rotateLeft(tree, parent);
+                x = tree->root;
+                parent = NULL;
+            }
+        } else {
+            rb_node_t* sibling = parent->left;
+            if (isRed(sibling)) {
+                sibling->red = false;
+                parent->red = true;
+                rotateRight(tree, parent);
+                sibling = parent->left;
+            }
+            if (!isRed(sibling->left) && !isRed(sibling->right)) {
+                sibling->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!isRed(sibling->left)) {
+                    sibling->right->red = false;
+                    sibling->red = true;
+                    rotateLeft(tree, sibling);
+                    sibling = parent->left;
+                }
+                sibling->red = parent->red;
+                parent->red = false;
+                sibling->left->red = false;
+                rotateRight(tree, parent);
+                x = tree->root;
+                parent = NULL;
+            }
+        }
+    }
+
+    if (x != NULL) {
+        x->red = false;
+    }
+}
+
+void rbRemove(rb_tree_t* tree, rb_node_t* z) {
+    KASSERT(tree);
+    KASSERT(z);
+
+    if (tree->leftmost == z) {
+        tree->leftmost = rbNext(z);
+    }
+
+    rb_node_t* x;
+    rb_node_t* xParent;
+    bool removedRed = z->red;
+
+    if (z->left == NULL) {
+        x = z->right;
+        xParent = z->parent;
+        transplant(tree, z, z->right);
+    } else if (z->right == NULL) {
+        x = z->left;
+        xParent = z->parent;
+        transplant(tree, z, z->left);
+    } else {
+        /* z has two children: splice out its successor y instead */
+        rb_node_t* y = minimum(z->right);
+        removedRed = y->red;
+        x = y->right;
+
+        if (y->parent == z) {
+            xParent = y;
+        } else {
+            xParent = y->parent;
+            transplant(tree, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+
+        transplant(tree, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+
+    if (!removedRed) {
+        removeFixup(tree, x, xParent);
+    }
+
+    z->parent = NULL;
+    z->left = NULL;
+    z->right = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef MAROX_RBTREE_H
+#define MAROX_RBTREE_H
+
+#include "marox.h"
+
+/*
+ * Intrusive red-black tree. Nodes are embedded in the objects they
+ * order; RB_ENTRY() gets back to the containing object. The tree
+ * caches its leftmost (smallest) node, so rbFirst() is O(1).
+ */
+
+struct rb_node {
+    struct rb_node* parent;
+    struct rb_node* left;
+    struct rb_node* right;
+    bool red;
+};
+typedef struct rb_node rb_node_t;
+
+/* ordering of two nodes: true if a sorts before b */
+typedef bool (*rb_less_t)(rb_node_t* a, rb_node_t* b);
+
+struct rb_tree {
+    rb_node_t* root;
+    rb_node_t* leftmost;
+    rb_less_t less;
+};
+typedef struct rb_tree rb_tree_t;
+
+#define RB_ENTRY(node, type, member) \
+    ((type*)((char*)(node) - offsetof(type, member)))
+
+void rbInit(rb_tree_t* tree, rb_less_t less);
+void rbInsert(rb_tree_t* tree, rb_node_t* node);
+void rbRemove(rb_tree_t* tree, rb_node_t* node);
+rb_node_t* rbNext(rb_node_t* node);
+
+static inline rb_node_t* rbFirst(rb_tree_t* tree) {
+    return tree->leftmost;
+}
+
+static inline bool rbEmpty(rb_tree_t* tree) {
+    return tree->root == NULL;
+}
+
+#endif /* MAROX_RBTREE_H */
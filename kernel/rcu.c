@@ -0,0 +1,109 @@
+#include "int.h"
+#include "thread.h"
+#include "rcu.h"
+
+volatile uint32_t g_rcuGeneration;
+
+/*
+ * Callbacks waiting for their grace period, oldest first. Generations
+ * only grow along the list, so the callbacks that are ready to run are
+ * always a prefix of it. Protected by disabling interrupts, so that
+ * callRcu() may be called from interrupt handlers.
+ */
+static rcu_head_t* callbacksHead;
+static rcu_head_t* callbacksTail;
+
+/*
+ * Enter a read-side critical section. Sections nest, may be entered
+ * from interrupt handlers, and must not sleep.
+ */
+void rcuReadLock(void) {
+    disablePreemption();
+    ++getCurrentThread()->rcuNesting;
+}
+
+void rcuReadUnlock(void) {
+    thread_t* current = getCurrentThread();
+    KASSERT(current->rcuNesting > 0);
+    --current->rcuNesting;
+    enablePreemption();
+}
+
+/*
+ * Call `func(head)` once every reader that might have seen the object
+ * containing `head` is done with it. The callback runs in the reaper
+ * thread, with interrupts enabled.
+ * May be called from interrupt handlers.
+ */
+void callRcu(rcu_head_t* head, rcu_callback_t func) {
+    KASSERT(head);
+    KASSERT(func);
+
+    bool iFlag = begIntAtomic();
+
+    head->func = func;
+    head->generation = g_rcuGeneration;
+    head->next = NULL;
+    if (callbacksTail == NULL) {
+        callbacksHead = head;
+    } else {
+        callbacksTail->next = head;
+    }
+    callbacksTail = head;
+
+    wakeReaper();
+
+    endIntAtomic(iFlag);
+}
+
+/*
+ * Wait until every reader that was in a read-side section when this
+ * was called has left it. Threads only, outside read-side sections.
+ */
+void synchronizeRcu(void) {
+    KASSERT(interruptsEnabled());
+    KASSERT(getCurrentThread()->rcuNesting == 0);
+
+    uint32_t generation = g_rcuGeneration;
+    while (g_rcuGeneration == generation) {
+        yield();
+    }
+}
+
+bool rcuCallbacksPending(void) {
+    return callbacksHead != NULL;
+}
+
+/*
+ * Run the callbacks whose grace period has passed.
+ * Called with interrupts enabled.
+ *
+ * @returns the number of callbacks run
+ */
+unsigned int rcuRunCallbacks(void) {
+    KASSERT(interruptsEnabled());
+
+    /* take the ready prefix of the list */
+    cli();
+    rcu_head_t* ready = callbacksHead;
+    rcu_head_t** end = &ready;
+    while (*end != NULL && (*end)->generation != g_rcuGeneration) {
+        end = &(*end)->next;
+    }
+    callbacksHead = *end;
+    if (callbacksHead == NULL) {
+        callbacksTail = NULL;
+    }
+    *end = NULL;
+    sti();
+
+    unsigned int count = 0;
+    while (ready != NULL) {
+        rcu_head_t* next = ready->next;
+        ready->func(ready);
+        ready = next;
+        ++count;
+    }
+
+    return count;
+}
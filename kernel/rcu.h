@@ -0,0 +1,58 @@
+#ifndef MAROX_RCU_H
+#define MAROX_RCU_H
+
+#include "marox.h"
+
+/*
+ * Read-copy-update for read-mostly linked structures.
+ *
+ * Readers traverse without locks, between rcuReadLock() and
+ * rcuReadUnlock(), and must not sleep in between. Writers serialize
+ * among themselves, unlink with rcuAssignPointer(), and free what they
+ * unlinked only after a grace period, when no reader can still hold a
+ * reference: either by waiting in synchronizeRcu() or by handing it to
+ * callRcu().
+ *
+ * A read-side section only disables preemption, so on this single CPU
+ * every context switch is a quiescent state: a grace period has passed
+ * once the scheduler has switched (or picked a thread) since the
+ * object was unlinked.
+ */
+
+struct rcu_head;
+typedef void (*rcu_callback_t)(struct rcu_head* head);
+
+/* embedded in objects freed through callRcu(); RCU_ENTRY() gets back
+ * to the containing object */
+struct rcu_head {
+    struct rcu_head* next;
+    rcu_callback_t func;
+    uint32_t generation;        /* g_rcuGeneration when queued */
+};
+typedef struct rcu_head rcu_head_t;
+
+#define RCU_ENTRY(head, type, member) \
+    ((type*)((char*)(head) - offsetof(type, member)))
+
+/* publish a pointer once the object it points to is initialized */
+#define rcuAssignPointer(p, v)  __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* load a pointer exactly once, for a reader to follow */
+#define rcuDereference(p)       __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+/* number of quiescent states (context switches) so far */
+extern volatile uint32_t g_rcuGeneration;
+
+/* called by the scheduler whenever it switches threads */
+static inline void rcuQuiescentState(void) {
+    ++g_rcuGeneration;
+}
+
+void rcuReadLock(void);
+void rcuReadUnlock(void);
+void callRcu(rcu_head_t* head, rcu_callback_t func);
+void synchronizeRcu(void);
+bool rcuCallbacksPending(void);
+unsigned int rcuRunCallbacks(void);
+
+#endif /* MAROX_RCU_H */
@@ -0,0 +1,211 @@
+#include "int.h"
+#include "string.h"
+#include "ring.h"
+
+static inline bool isPowerOfTwo(uint32_t x) {
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+/*
+ * Copy n elements between a ring's slots (starting at index `pos`)
+ * and a flat array, in at most two pieces around the wrap.
+ */
+static void spscCopyIn(spsc_ring_t* ring, uint32_t pos, const uint8_t* elems, unsigned int n) {
+    uint32_t start = pos & ring->mask;
+    uint32_t first = ring->mask + 1 - start;
+    if (first > n) {
+        first = n;
+    }
+
+    memcpy(ring->slots + start * ring->elemSize, elems, first * ring->elemSize);
+    if (n > first) {
+        memcpy(ring->slots, elems + first * ring->elemSize, (n - first) * ring->elemSize);
+    }
+}
+
+static void spscCopyOut(spsc_ring_t* ring, uint32_t pos, uint8_t* elems, unsigned int n) {
+    uint32_t start = pos & ring->mask;
+    uint32_t first = ring->mask + 1 - start;
+    if (first > n) {
+        first = n;
+    }
+
+    memcpy(elems, ring->slots + start * ring->elemSize, first * ring->elemSize);
+    if (n > first) {
+        memcpy(elems + first * ring->elemSize, ring->slots, (n - first) * ring->elemSize);
+    }
+}
+
+/*
+ * `storage` must hold `count` elements of `elemSize` bytes;
+ * count must be a power of two.
+ */
+void spscInit(spsc_ring_t* ring, void* storage, uint32_t elemSize, uint32_t count) {
+    KASSERT(ring);
+    KASSERT(storage);
+    KASSERT(elemSize > 0);
+    KASSERT(isPowerOfTwo(count));
+
+    ring->head = 0;
+    ring->tailCache = 0;
+    ring->tail = 0;
+    ring->headCache = 0;
+    ring->slots = storage;
+    ring->mask = count - 1;
+    ring->elemSize = elemSize;
+}
+
+/*
+ * Append up to n elements. Producer side only.
+ *
+ * @returns the number of elements appended (fewer if the ring filled up)
+ */
+unsigned int spscEnqueue(spsc_ring_t* ring, const void* elems, unsigned int n) {
+    uint32_t tail = ring->tail;
+    uint32_t size = ring->mask + 1;
+
+    if (size - (tail - ring->headCache) < n) {
+        /* looks full: find out how far the consumer really got */
+        ring->headCache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t free = size - (tail - ring->headCache);
+        if (n > free) {
+            n = free;
+        }
+    }
+
+    if (n > 0) {
+        spscCopyIn(ring, tail, elems, n);
+        /* publish the elements only after they are written */
+        __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+    }
+
+    return n;
+}
+
+/*
+ * Take up to n elements. Consumer side only.
+ *
+ * @returns the number of elements taken
+ */
+unsigned int spscDequeue(spsc_ring_t* ring, void* elems, unsigned int n) {
+    uint32_t head = ring->head;
+
+    if (ring->tailCache - head < n) {
+        ring->tailCache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint32_t available = ring->tailCache - head;
+        if (n > available) {
+            n = available;
+        }
+    }
+
+    if (n > 0) {
+        spscCopyOut(ring, head, elems, n);
+        /* hand the slots back only after they are read */
+        __atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+    }
+
+    return n;
+}
+
+/* consumer side: is there nothing to take? */
+bool spscEmpty(spsc_ring_t* ring) {
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head;
+}
+
+/* producer side: how many elements fit right now? */
+unsigned int spscFree(spsc_ring_t* ring) {
+    ring->headCache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return ring->mask + 1 - (ring->tail - ring->headCache);
+}
+
+static inline volatile uint32_t* mpscSeq(mpsc_ring_t* ring, uint32_t pos) {
+    return (volatile uint32_t*)(ring->slots + (pos & ring->mask) * ring->slotSize);
+}
+
+static inline uint8_t* mpscData(mpsc_ring_t* ring, uint32_t pos) {
+    return ring->slots + (pos & ring->mask) * ring->slotSize + sizeof(uint32_t);
+}
+
+/*
+ * `storage` must hold `count * MPSC_SLOT_SIZE(elemSize)` bytes;
+ * count must be a power of two.
+ */
+void mpscInit(mpsc_ring_t* ring, void* storage, uint32_t elemSize, uint32_t count) {
+    KASSERT(ring);
+    KASSERT(storage);
+    KASSERT(elemSize > 0);
+    KASSERT(isPowerOfTwo(count));
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->slots = storage;
+    ring->mask = count - 1;
+    ring->elemSize = elemSize;
+    ring->slotSize = MPSC_SLOT_SIZE(elemSize);
+
+    /* slot i is free for the producer that claims position i */
+    for (uint32_t i = 0; i < count; ++i) {
+        *mpscSeq(ring, i) = i;
+    }
+}
+
+/*
+ * Append up to n elements, as one contiguous batch. Safe to call from
+ * any number of threads and interrupt handlers at once.
+ *
+ * @returns the number of elements appended (fewer if the ring filled up)
+ */
+unsigned int mpscEnqueue(mpsc_ring_t* ring, const void* elems, unsigned int n) {
+    /* one CPU: holding off interrupts is enough to claim slots, and
+     * a compare-and-swap would need libatomic on plain i386 */
+    bool iFlag = begIntAtomic();
+    uint32_t pos = ring->tail;
+
+    /* a slot is free once the consumer has set its sequence
+     * number to the position that reuses it */
+    unsigned int claimed = 0;
+    while (claimed < n &&
+            __atomic_load_n(mpscSeq(ring, pos + claimed), __ATOMIC_ACQUIRE) == pos + claimed) {
+        ++claimed;
+    }
+    ring->tail = pos + claimed;
+    endIntAtomic(iFlag);
+
+    const uint8_t* src = elems;
+    for (unsigned int i = 0; i < claimed; ++i) {
+        memcpy(mpscData(ring, pos + i), src + i * ring->elemSize, ring->elemSize);
+        /* publish: sequence number one past the position */
+        __atomic_store_n(mpscSeq(ring, pos + i), pos + i + 1, __ATOMIC_RELEASE);
+    }
+
+    return claimed;
+}
+
+/*
+ * Take up to n elements, stopping at the first slot that has been
+ * claimed but not yet published. Consumer side only.
+ *
+ * @returns the number of elements taken
+ */
+unsigned int mpscDequeue(mpsc_ring_t* ring, void* elems, unsigned int n) {
+    uint32_t head = ring->head;
+    uint32_t size = ring->mask + 1;
+    uint8_t* dst = elems;
+
+    unsigned int taken = 0;
+    while (taken < n) {
+        uint32_t pos = head + taken;
+        if (__atomic_load_n(mpscSeq(ring, pos), __ATOMIC_ACQUIRE) != pos + 1) {
+            break;
+        }
+
+        memcpy(dst + taken * ring->elemSize, mpscData(ring, pos), ring->elemSize);
+        /* free the slot for the producer of position pos + size */
+        __atomic_store_n(mpscSeq(ring, pos), pos + size, __ATOMIC_RELEASE);
+        ++taken;
+    }
+
+    ring->head = head + taken;
+
+    return taken;
+}
@@ -0,0 +1,79 @@
+#ifndef MAROX_RING_H
+#define MAROX_RING_H
+
+#include "marox.h"
+
+/*
+ * Lock-free ring buffers of fixed-size elements, for streams between
+ * interrupt handlers and threads, or between threads.
+ *
+ * Indices run freely and wrap at 2^32; the number of slots must be a
+ * power of two. Producer and consumer indices sit on separate cache
+ * lines so the two sides do not keep stealing each other's line.
+ * The storage is provided by the caller.
+ */
+
+enum { CACHE_LINE_SIZE = 64 };
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+
+/*
+ * Single producer, single consumer. Each side only writes its own
+ * index and keeps a cached copy of the other's, so most operations
+ * touch no shared cache line at all. If there are several producers
+ * (or consumers), they must be serialized by the caller.
+ */
+struct spsc_ring {
+    /* consumer side */
+    volatile uint32_t head CACHE_ALIGNED;
+    uint32_t tailCache;
+
+    /* producer side */
+    volatile uint32_t tail CACHE_ALIGNED;
+    uint32_t headCache;
+
+    /* read-only after init */
+    uint8_t* slots CACHE_ALIGNED;
+    uint32_t mask;
+    uint32_t elemSize;
+};
+typedef struct spsc_ring spsc_ring_t;
+
+void spscInit(spsc_ring_t* ring, void* storage, uint32_t elemSize, uint32_t count);
+unsigned int spscEnqueue(spsc_ring_t* ring, const void* elems, unsigned int n);
+unsigned int spscDequeue(spsc_ring_t* ring, void* elems, unsigned int n);
+bool spscEmpty(spsc_ring_t* ring);
+unsigned int spscFree(spsc_ring_t* ring);
+
+/*
+ * Multiple producers (threads and interrupt handlers alike), single
+ * consumer. Producers claim slots by moving the tail with interrupts
+ * briefly disabled (the kernel is uniprocessor), then fill and publish
+ * each slot through its own sequence number, so a producer interrupted
+ * while copying never blocks the others; the consumer simply
+ * stops at the first unpublished slot.
+ *
+ * Each slot holds a sequence number followed by the element, so the
+ * storage must be `count * MPSC_SLOT_SIZE(elemSize)` bytes.
+ */
+#define MPSC_SLOT_SIZE(elemSize)    (sizeof(uint32_t) + (((elemSize) + 3) & ~3u))
+
+struct mpsc_ring {
+    /* consumer side */
+    volatile uint32_t head CACHE_ALIGNED;
+
+    /* producer side */
+    volatile uint32_t tail CACHE_ALIGNED;
+
+    /* read-only after init */
+    uint8_t* slots CACHE_ALIGNED;
+    uint32_t mask;
+    uint32_t elemSize;
+    uint32_t slotSize;
+};
+typedef struct mpsc_ring mpsc_ring_t;
+
+void mpscInit(mpsc_ring_t* ring, void* storage, uint32_t elemSize, uint32_t count);
+unsigned int mpscEnqueue(mpsc_ring_t* ring, const void* elems, unsigned int n);
+unsigned int mpscDequeue(mpsc_ring_t* ring, void* elems, unsigned int n);
+
+#endif /* MAROX_RING_H */
@@ -1,6 +1,7 @@
 #include "irq.h"
 #include "io.h"
 #include "rtc.h"
+#include "sync.h"
 
 
 static char* months[] = {
@@ -12,7 +13,9 @@ static char* days[] = {
     "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
 };
 
+/* written by rtcHandler, read locklessly by dateTime() */
 static struct tm g_dateTime;
+static seqlock_t g_dateTimeLock;
 static bool CMOS_BCD_VALUES = 0;
 
 
@@ -41,13 +44,17 @@ char* monthName(uint8_t mon) {
 }
 
 void dateTime(struct tm *time) {
-    time->sec = g_dateTime.sec;
-    time->min = g_dateTime.min;
-    time->hour = g_dateTime.hour;
-    time->wday = g_dateTime.wday;
-    time->mday = g_dateTime.mday;
-    time->month = g_dateTime.month;
-    time->year = g_dateTime.year;
+    uint32_t seq;
+    do {
+        seq = readSeqBegin(&g_dateTimeLock);
+        time->sec = g_dateTime.sec;
+        time->min = g_dateTime.min;
+        time->hour = g_dateTime.hour;
+        time->wday = g_dateTime.wday;
+        time->mday = g_dateTime.mday;
+        time->month = g_dateTime.month;
+        time->year = g_dateTime.year;
+    } while (readSeqRetry(&g_dateTimeLock, seq));
     time->yday = 0;
     time->isDst = 0;
 }
@@ -108,6 +115,7 @@ void rtcHandler(struct regs *r) {
             year += 100;
         }
 
+        writeSeqBegin(&g_dateTimeLock);
         g_dateTime.sec = sec;
         g_dateTime.min = min;
         g_dateTime.hour = hour;
@@ -117,6 +125,7 @@ void rtcHandler(struct regs *r) {
         g_dateTime.year = year;
         g_dateTime.yday = 0;
         g_dateTime.isDst = 0;
+        writeSeqEnd(&g_dateTimeLock);
     }
 
     /* register C must be read for another interrupt to occur
@@ -126,6 +135,7 @@ void rtcHandler(struct regs *r) {
 }
 
 void rtcInit(void) {
+    seqlockInit(&g_dateTimeLock);
     initIrqHandler(IRQ_RTC, rtcHandler);
 
     /* determine if values are packed BCD or Binary */
@@ -203,6 +203,8 @@ isr_no_err intno
 
 
 extern base_int_handler
+extern g_need_reschedule
+extern preemptFromIrq
 ; Common ISR stub
 ; Save processor state, set up for kernel mode segments,
 ; call C-level fault handler, restore processor state
@@ -218,6 +220,13 @@ isr_common_stub:
     mov eax, base_int_handler
     call eax        ; A special call, preserves the 'eip' register
     pop eax         ; Pop pointer to stack (struct regs *)
+
+    ; a system call may have woken a thread that should run before us
+    cmp [g_need_reschedule], dword 0
+    je .restore
+    call preemptFromIrq
+
+.restore:
     popregs
     add esp, 8      ; Cleans up pushed error code and pushed ISR number
     iret            ; pop EIP, CS, EFLAGS, SS, and ESP; jump to EIP
@@ -253,8 +262,6 @@ irq_handle 15    ; IRQ 14 (IDT 47)
 
 
 extern baseIrqHandler
-extern g_need_reschedule
-extern schedule
 ; calls baseIrqHandler defined in 'irq.c'
 irq_common_stub:
     pushregs
@@ -268,17 +275,16 @@ irq_common_stub:
     mov eax, baseIrqHandler
     call eax        ; preserves EIP ?
     pop eax
-    popregs
-    add esp, 8      ; clean up pushed error code and ISR number
 
-    ; handle preemption after handling interrupt and sending PIC end-of-interrupt
+    ; handle preemption after handling interrupt and sending PIC end-of-interrupt,
+    ; while the interrupted thread's registers are still saved on its stack
     cmp [g_need_reschedule], dword 0
     je .restore
-    mov [g_need_reschedule], dword 0
-
-    call schedule
+    call preemptFromIrq
 
 .restore:
+    popregs
+    add esp, 8      ; clean up pushed error code and ISR number
     iret            ; pop EIP, CS, EFLAGS, SS, and ESP; jump to EIP
 
 
@@ -286,12 +292,61 @@ irq_common_stub:
 ; when switchToThread is called, the stack looks like:
 ;       - pointer to thread
 ;       - func return address
+; It is only called from C, so only the callee-saved registers
+; (ebx, ebp, esi, edi) need to be kept; eax, ecx and edx are
+; clobbered as with any other call.
 extern g_current_thread
-extern setKernelStack
+extern g_tss
 global switchToThread
 switchToThread:
     ;xchg bx, bx         ; BOCHS magic breakpoint
 
+    mov eax, [esp + 4]          ; load pointer to new thread
+    mov edx, [g_current_thread]
+    mov [edx+4], dword 0        ; clear numTicks field
+
+    cmp eax, edx                ; picked the running thread again?
+    je .done
+
+.save:
+    push ebx
+    push ebp
+    push esi
+    push edi
+
+    mov [edx+0], esp            ; set thread's stack pointer
+
+    mov [g_current_thread], eax ; update new current thread
+    mov esp, [eax+0]            ; update ESP
+
+    mov ecx, [eax+12]           ; TSS esp0 = new thread's stackTop
+    mov [g_tss+4], ecx
+
+    pop edi
+    pop esi
+    pop ebp
+    pop ebx
+
+.done:
+    ret
+
+%ifdef MAROX_BENCH
+; For benchContextSwitch only: switchToThread's save/restore path,
+; taken even when switching to the running thread.
+global switchToThreadFull
+switchToThreadFull:
+    mov eax, [esp + 4]
+    mov edx, [g_current_thread]
+    mov [edx+4], dword 0
+    jmp switchToThread.save
+
+; For benchContextSwitch only: switchToThread as it was before it was
+; slimmed down (all general registers, setKernelStack() call). Its
+; frame does not match setupThreadStack(), so it may only be used to
+; switch to the running thread.
+extern setKernelStack
+global switchToThreadOld
+switchToThreadOld:
     push eax
     push ecx
     push edx
@@ -304,8 +359,7 @@ switchToThread:
     mov [eax+0], esp            ; set thread's stack pointer
     mov [eax+4], dword 0        ; clear numTicks field
 
-    mov eax, [esp + 32] ; load pointer to new thread, skipping sizeof(struct regs)
-
+    mov eax, [esp + 32]         ; load pointer to new thread
     mov [g_current_thread], eax ; update new current thread
     mov esp, [eax+0]            ; update ESP
 
@@ -322,6 +376,7 @@ switchToThread:
     pop eax
 
     ret
+%endif
 
 
 global startUserMode
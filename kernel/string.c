@@ -1,9 +1,21 @@
 #include "string.h"
+#include "thread.h"
+
+/* large fills give the scheduler a chance every MEMSET_CHUNK bytes */
+enum { MEMSET_CHUNK = 0x1000 };
 
 void *memset(void *b, int c, size_t len) {
     uint8_t *s = b;
-    while (--len) {
-        *s++ = (uint8_t)c;
+    while (len > 0) {
+        size_t n = (len < MEMSET_CHUNK) ? len : MEMSET_CHUNK;
+        len -= n;
+        while (n--) {
+            *s++ = (uint8_t)c;
+        }
+
+        if (len > 0) {
+            condResched();
+        }
     }
 
     return b;
@@ -0,0 +1,271 @@
+#include "int.h"
+#include "thread.h"
+#include "timer.h"
+#include "sync.h"
+
+/*
+ * Lock state is protected by disabling interrupts.
+ */
+
+void rwlockInit(rwlock_t* lock) {
+    KASSERT(lock);
+    lock->readers = 0;
+    lock->writing = false;
+    lock->waitingWriters = 0;
+    threadQueueInitPriority(&lock->readQueue);
+    threadQueueInitPriority(&lock->writeQueue);
+}
+
+void readLock(rwlock_t* lock) {
+    KASSERT(lock);
+
+    bool iFlag = begIntAtomic();
+
+    while (lock->writing || lock->waitingWriters > 0) {
+        wait(&lock->readQueue);
+    }
+    ++lock->readers;
+
+    endIntAtomic(iFlag);
+}
+
+void readUnlock(rwlock_t* lock) {
+    KASSERT(lock);
+
+    bool iFlag = begIntAtomic();
+
+    KASSERT(lock->readers > 0);
+    if (--lock->readers == 0) {
+        wakeOne(&lock->writeQueue);
+    }
+
+    endIntAtomic(iFlag);
+}
+
+void writeLock(rwlock_t* lock) {
+    KASSERT(lock);
+
+    bool iFlag = begIntAtomic();
+
+    ++lock->waitingWriters;
+    while (lock->writing || lock->readers > 0) {
+        wait(&lock->writeQueue);
+    }
+    --lock->waitingWriters;
+    lock->writing = true;
+
+    endIntAtomic(iFlag);
+}
+
+void writeUnlock(rwlock_t* lock) {
+    KASSERT(lock);
+
+    bool iFlag = begIntAtomic();
+
+    KASSERT(lock->writing);
+    lock->writing = false;
+
+    /* hand over to the next writer, or else let all readers in */
+    if (lock->waitingWriters > 0) {
+        wakeOne(&lock->writeQueue);
+    } else {
+        wakeAll(&lock->readQueue);
+    }
+
+    endIntAtomic(iFlag);
+}
+
+void semInit(semaphore_t* sem, unsigned int count) {
+    KASSERT(sem);
+    sem->count = count;
+    threadQueueInitPriority(&sem->waitQueue);
+}
+
+void semDown(semaphore_t* sem) {
+    KASSERT(sem);
+
+    bool iFlag = begIntAtomic();
+
+    while (sem->count == 0) {
+        waitExclusive(&sem->waitQueue);
+    }
+    --sem->count;
+
+    endIntAtomic(iFlag);
+}
+
+/*
+ * @returns false if the count stayed zero for the given number of
+ *          milliseconds
+ */
+bool semDownTimeout(semaphore_t* sem, unsigned int milliseconds) {
+    KASSERT(sem);
+
+    uint32_t deadline = getTicks() + msecsToTicks(milliseconds);
+    bool acquired = false;
+
+    bool iFlag = begIntAtomic();
+
+    while (true) {
+        if (sem->count > 0) {
+            --sem->count;
+            acquired = true;
+            break;
+        }
+
+        uint32_t left = ticksUntil(deadline);
+        if (left == 0) {
+            break;
+        }
+        waitExclusiveTimeout(&sem->waitQueue, left);
+    }
+
+    endIntAtomic(iFlag);
+
+    return acquired;
+}
+
+bool semTryDown(semaphore_t* sem) {
+    KASSERT(sem);
+
+    bool iFlag = begIntAtomic();
+
+    bool acquired = sem->count > 0;
+    if (acquired) {
+        --sem->count;
+    }
+
+    endIntAtomic(iFlag);
+
+    return acquired;
+}
+
+/*
+ * @returns the thread woken to take the count (NULL if none was
+ *          waiting), so a thread handing over work can yieldTo() it
+ */
+thread_t* semUp(semaphore_t* sem) {
+    KASSERT(sem);
+
+    bool iFlag = begIntAtomic();
+
+    ++sem->count;
+    thread_t* woken = wakeOne(&sem->waitQueue);
+
+    endIntAtomic(iFlag);
+
+    return woken;
+}
+
+void condInit(condvar_t* cond) {
+    KASSERT(cond);
+    threadQueueInitPriority(&cond->waitQueue);
+}
+
+/*
+ * Release the mutex and wait for a signal, for at most `ticks`
+ * timer ticks (WAIT_FOREVER: no limit). The mutex is held again on
+ * return.
+ *
+ * With preemption disabled, no other thread can run between the
+ * unlock and the wait, so no signal is lost in between.
+ */
+static bool condWaitTicks(condvar_t* cond, mutex_t* mutex, uint32_t ticks) {
+    KASSERT(interruptsEnabled());
+    KASSERT(cond);
+    KASSERT(mutexHeld(mutex));
+
+    bool signalled = true;
+
+    disablePreemption();
+    mutex_unlock(mutex);
+
+    cli();
+    if (ticks == WAIT_FOREVER) {
+        wait(&cond->waitQueue);
+    } else {
+        signalled = waitTimeout(&cond->waitQueue, ticks);
+    }
+    sti();
+
+    enablePreemption();
+    mutexLock(mutex);
+
+    return signalled;
+}
+
+void condWait(condvar_t* cond, mutex_t* mutex) {
+    condWaitTicks(cond, mutex, WAIT_FOREVER);
+}
+
+/*
+ * @returns false if not signalled within the given number of milliseconds
+ */
+bool condWaitTimeout(condvar_t* cond, mutex_t* mutex, unsigned int milliseconds) {
+    return condWaitTicks(cond, mutex, msecsToTicks(milliseconds));
+}
+
+void condSignal(condvar_t* cond) {
+    KASSERT(cond);
+
+    bool iFlag = begIntAtomic();
+    wakeOne(&cond->waitQueue);
+    endIntAtomic(iFlag);
+}
+
+void condBroadcast(condvar_t* cond) {
+    KASSERT(cond);
+
+    bool iFlag = begIntAtomic();
+    wakeAll(&cond->waitQueue);
+    endIntAtomic(iFlag);
+}
+
+void completionInit(completion_t* comp) {
+    KASSERT(comp);
+    comp->done = false;
+    threadQueueInitPriority(&comp->waitQueue);
+}
+
+void complete(completion_t* comp) {
+    KASSERT(comp);
+
+    bool iFlag = begIntAtomic();
+    comp->done = true;
+    wakeAll(&comp->waitQueue);
+    endIntAtomic(iFlag);
+}
+
+void waitForCompletion(completion_t* comp) {
+    KASSERT(comp);
+
+    bool iFlag = begIntAtomic();
+    while (!comp->done) {
+        wait(&comp->waitQueue);
+    }
+    endIntAtomic(iFlag);
+}
+
+/*
+ * @returns false if not completed within the given number of milliseconds
+ */
+bool waitForCompletionTimeout(completion_t* comp, unsigned int milliseconds) {
+    KASSERT(comp);
+
+    uint32_t deadline = getTicks() + msecsToTicks(milliseconds);
+
+    bool iFlag = begIntAtomic();
+
+    while (!comp->done) {
+        uint32_t left = ticksUntil(deadline);
+        if (left == 0) {
+            break;
+        }
+        waitTimeout(&comp->waitQueue, left);
+    }
+    bool done = comp->done;
+
+    endIntAtomic(iFlag);
+
+    return done;
+}
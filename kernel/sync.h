@@ -0,0 +1,113 @@
+#ifndef MAROX_SYNC_H
+#define MAROX_SYNC_H
+
+#include "marox.h"
+#include "thread.h"
+
+/* keep the compiler from moving memory accesses across this point */
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+/*
+ * Reader-writer lock: any number of readers, or one writer.
+ * Waiting writers keep new readers out, so a steady stream of readers
+ * cannot starve a writer. Both sides may sleep, so these locks can
+ * only be taken by threads, not by interrupt handlers.
+ */
+struct rwlock {
+    unsigned int readers;           /* readers holding the lock */
+    bool writing;                   /* a writer holds the lock */
+    unsigned int waitingWriters;
+    thread_queue_t readQueue;
+    thread_queue_t writeQueue;
+};
+typedef struct rwlock rwlock_t;
+
+void rwlockInit(rwlock_t* lock);
+void readLock(rwlock_t* lock);
+void readUnlock(rwlock_t* lock);
+void writeLock(rwlock_t* lock);
+void writeUnlock(rwlock_t* lock);
+
+/*
+ * Counting semaphore. semUp() may be called from interrupt handlers.
+ */
+struct semaphore {
+    unsigned int count;
+    thread_queue_t waitQueue;
+};
+typedef struct semaphore semaphore_t;
+
+void semInit(semaphore_t* sem, unsigned int count);
+void semDown(semaphore_t* sem);
+bool semDownTimeout(semaphore_t* sem, unsigned int milliseconds);
+bool semTryDown(semaphore_t* sem);
+thread_t* semUp(semaphore_t* sem);
+
+/*
+ * Condition variable, used together with a mutex that protects the
+ * condition. condWait() releases the mutex and starts waiting
+ * atomically, so a signal sent after the waiter checked the condition
+ * cannot be lost. Signal from threads only, with the mutex held.
+ */
+struct condvar {
+    thread_queue_t waitQueue;
+};
+typedef struct condvar condvar_t;
+
+void condInit(condvar_t* cond);
+void condWait(condvar_t* cond, mutex_t* mutex);
+bool condWaitTimeout(condvar_t* cond, mutex_t* mutex, unsigned int milliseconds);
+void condSignal(condvar_t* cond);
+void condBroadcast(condvar_t* cond);
+
+/* completions are declared in thread.h, since threads embed one */
+
+/*
+ * Sequence lock: readers never block the writer. A reader takes a
+ * snapshot of the sequence number, reads, and retries if a write
+ * happened meanwhile:
+ *
+ *     do {
+ *         seq = readSeqBegin(&lock);
+ *         copy = data;
+ *     } while (readSeqRetry(&lock, seq));
+ *
+ * The sequence number is odd while a write is in progress. Writers
+ * must be serialized by the caller and must not be preempted in the
+ * middle of a write (e.g. write from an interrupt handler, or with
+ * interrupts disabled), or readers would spin until they resume.
+ */
+struct seqlock {
+    volatile uint32_t seq;
+};
+typedef struct seqlock seqlock_t;
+
+static inline void seqlockInit(seqlock_t* lock) {
+    lock->seq = 0;
+}
+
+static inline uint32_t readSeqBegin(seqlock_t* lock) {
+    uint32_t seq;
+    do {
+        seq = lock->seq;
+    } while (seq & 1);
+    barrier();
+    return seq;
+}
+
+static inline bool readSeqRetry(seqlock_t* lock, uint32_t seq) {
+    barrier();
+    return lock->seq != seq;
+}
+
+static inline void writeSeqBegin(seqlock_t* lock) {
+    ++lock->seq;
+    barrier();
+}
+
+static inline void writeSeqEnd(seqlock_t* lock) {
+    barrier();
+    ++lock->seq;
+}
+
+#endif /* MAROX_SYNC_H */
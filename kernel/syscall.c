@@ -6,6 +6,7 @@
 #include "mem.h"
 #include "thread.h"
 #include "kb.h"
+#include "futex.h"
 
 static void print(const char *msg) {
     kprintf("%s", msg);
@@ -22,6 +23,8 @@ DEFN_SYSCALL0(shmGet, 7)
 DEFN_SYSCALL1(shmRelease, 8, int)
 DEFN_SYSCALL2(shmWrite, 9, int, char*)
 DEFN_SYSCALL2(shmRead, 10, int, char*)
+DEFN_SYSCALL2(futexWait, 11, volatile uint32_t*, uint32_t)
+DEFN_SYSCALL2(futexWake, 12, volatile uint32_t*, unsigned int)
 
 static void *syscalls[] = {
     &print,
@@ -34,7 +37,9 @@ static void *syscalls[] = {
     &shmGet,
     &shmRelease,
     &shmWrite,
-    &shmRead
+    &shmRead,
+    &futexWait,
+    &futexWake
 };
 size_t num_syscalls = sizeof(syscalls) / sizeof(*syscalls);
 
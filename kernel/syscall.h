@@ -1,6 +1,8 @@
 #ifndef MAROX_SYSCALL_H
 #define MAROX_SYSCALL_H
 
+#include "marox.h"
+
 void syscallsInit(void);
 
 #define DECL_SYSCALL0(fn) int syscall_##fn();
@@ -71,5 +73,8 @@ DECL_SYSCALL1(shmRelease, int)
 DECL_SYSCALL2(shmWrite, int, char*)
 DECL_SYSCALL2(shmRead, int, char*)
 
+DECL_SYSCALL2(futexWait, volatile uint32_t*, uint32_t)
+DECL_SYSCALL2(futexWake, volatile uint32_t*, unsigned int)
+
 
 #endif /* MAROX_SYSCALL_H */
@@ -0,0 +1,195 @@
+#include "int.h"
+#include "mem.h"
+#include "string.h"
+#include "thread.h"
+#include "timer.h"
+#include "task.h"
+
+/* Tasks ready to run their next step, in FIFO order */
+static task_t* readyHead;
+static task_t* readyTail;
+
+/* Queue for the executor thread to wait for ready tasks */
+static thread_queue_t executorWaitQueue;
+
+/*
+ * Remove a task from the ready list.
+ * Called with interrupts disabled.
+ */
+static void removeReady(task_t* task) {
+    KASSERT(!interruptsEnabled());
+
+    task_t* prev = NULL;
+    task_t** t = &readyHead;
+    while (*t != NULL) {
+        if (*t == task) {
+            *t = task->next;
+            if (readyTail == task) {
+                readyTail = prev;
+            }
+            break;
+        }
+        prev = *t;
+        t = &(*t)->next;
+    }
+
+    task->next = NULL;
+    task->ready = false;
+}
+
+/*
+ * Drop any wakeups the task has registered.
+ * Called with interrupts disabled.
+ */
+static void cancelWakeups(task_t* task) {
+    KASSERT(!interruptsEnabled());
+    waitHookRemove(&task->hook);
+    ktimerCancel(&task->timer);
+}
+
+static void hookFired(wait_hook_t* hook) {
+    task_t* task = hook->data;
+    task->timedOut = false;
+    taskWake(task);
+}
+
+static void timerFired(ktimer_t* timer) {
+    task_t* task = timer->data;
+    task->timedOut = true;
+    taskWake(task);
+}
+
+/*
+ * Run task steps forever, on behalf of all tasks.
+ */
+static void executor(uint32_t arg) {
+    (void)arg; /* prevent compiler warnings */
+    DEBUG("Task executor running\n");
+    cli();
+
+    while (true) {
+        task_t* task = readyHead;
+        if (task == NULL) {
+            wait(&executorWaitQueue);
+            continue;
+        }
+
+        readyHead = task->next;
+        if (readyHead == NULL) {
+            readyTail = NULL;
+        }
+        task->next = NULL;
+        task->ready = false;
+
+        sti();
+        task_status_t status = task->func(task);
+        cli();
+
+        switch (status) {
+            case TASK_DONE:
+                cancelWakeups(task);
+                if (task->ready) {
+                    removeReady(task);
+                }
+                free(task);
+                break;
+            case TASK_YIELD:
+                taskWake(task);
+                break;
+            case TASK_BLOCKED:
+                /* a blocked task must have a way to be woken */
+                KASSERT(task->ready || task->hook.queue != NULL || task->timer.pending);
+                break;
+        }
+    }
+}
+
+/*
+ * Start the executor thread.
+ * Must be called after the scheduler is initialized.
+ */
+void tasksInit(void) {
+    spawnThread(executor, 0, PRIORITY_NORMAL, true, false);
+}
+
+/*
+ * Create a task and make it ready to run its first step.
+ *
+ * @returns NULL if out of memory
+ */
+task_t* taskSpawn(task_func_t func, void* data) {
+    KASSERT(func);
+
+    task_t* task = malloc(sizeof(task_t));
+    if (!task) {
+        kprintf("Failed to allocate task\n");
+        return NULL;
+    }
+
+    memset(task, 0, sizeof(task_t));
+    task->func = func;
+    task->data = data;
+    waitHookInit(&task->hook, hookFired, task);
+    ktimerInit(&task->timer, timerFired, task);
+
+    taskWake(task);
+
+    return task;
+}
+
+/*
+ * Put a task on the ready list, cancelling its other wakeups.
+ * May be called from interrupt handlers.
+ */
+void taskWake(task_t* task) {
+    KASSERT(task);
+
+    bool iFlag = begIntAtomic();
+
+    cancelWakeups(task);
+
+    if (!task->ready) {
+        task->ready = true;
+        task->next = NULL;
+        if (readyTail == NULL) {
+            readyHead = task;
+        } else {
+            readyTail->next = task;
+        }
+        readyTail = task;
+
+        wakeOne(&executorWaitQueue);
+    }
+
+    endIntAtomic(iFlag);
+}
+
+/*
+ * Resume the task once the queue is woken.
+ * Can be combined with taskSleep() for a wait with timeout.
+ *
+ * As with wait(), callers that check a condition first must do so
+ * with interrupts disabled, or a wakeup may be missed.
+ */
+void taskWaitOn(task_t* task, thread_queue_t* waitQueue) {
+    KASSERT(task);
+    KASSERT(waitQueue);
+
+    bool iFlag = begIntAtomic();
+    task->timedOut = false;
+    waitHookRemove(&task->hook);
+    waitHookAdd(waitQueue, &task->hook);
+    endIntAtomic(iFlag);
+}
+
+/*
+ * Resume the task after (at least) the given number of milliseconds.
+ */
+void taskSleep(task_t* task, unsigned int milliseconds) {
+    KASSERT(task);
+
+    bool iFlag = begIntAtomic();
+    task->timedOut = false;
+    ktimerSet(&task->timer, getTicks() + msecsToTicks(milliseconds));
+    endIntAtomic(iFlag);
+}
@@ -0,0 +1,55 @@
+#ifndef MAROX_TASK_H
+#define MAROX_TASK_H
+
+#include "marox.h"
+#include "thread.h"
+#include "timer.h"
+
+/*
+ * Stackless tasks: a task is a small heap object whose step function
+ * is called by a shared executor thread. Instead of blocking, a step
+ * registers a wakeup (taskWaitOn/taskSleep) and returns TASK_BLOCKED;
+ * `state` can be used as a continuation label to resume where it left off.
+ */
+
+/* what a step wants to happen next */
+enum task_status {
+    TASK_DONE,      /* finished, free the task */
+    TASK_YIELD,     /* run again after the other ready tasks */
+    TASK_BLOCKED    /* resume on the registered wakeup */
+};
+typedef enum task_status task_status_t;
+
+struct task;
+typedef task_status_t (*task_func_t)(struct task* task);
+
+struct task {
+    task_func_t func;
+    void* data;
+
+    /* continuation label, free for use by func (starts at 0) */
+    unsigned int state;
+
+    /* set if the last wakeup came from the timer rather than a queue */
+    bool timedOut;
+
+    /* on the executor's ready list */
+    bool ready;
+
+    wait_hook_t hook;
+    ktimer_t timer;
+
+    /* link to next task in the ready list */
+    struct task* next;
+};
+typedef struct task task_t;
+
+void tasksInit(void);
+
+task_t* taskSpawn(task_func_t func, void* data);
+void taskWake(task_t* task);
+
+void taskWaitOn(task_t* task, thread_queue_t* waitQueue);
+void taskSleep(task_t* task, unsigned int milliseconds);
+
+#endif /* MAROX_TASK_H */
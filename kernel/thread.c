@@ -30,16 +30,49 @@
 #include "mem.h"
 #include "int.h"
 #include "timer.h"
+#include "clock.h"
 #include "string.h"
 #include "thread.h"
 #include "syscall.h"
 
 /* List of all threads in the system */
 static thread_t* allThreadHead;
+/* serializes changes to the list; readers use RCU instead */
+static mutex_t allThreadsLock;
 
-/* Queue of runnable threads */
+/* Queue of runnable threads (SCHED_PRIORITY) */
 static thread_queue_t runQueue;
 
+/* Queues of runnable SCHED_MLFQ threads, one per level */
+static thread_queue_t mlfqQueues[MLFQ_LEVELS];
+
+/* Current MLFQ boost period, and ticks since it started */
+static unsigned int g_mlfqEpoch;
+static unsigned int g_mlfqBoostTicks;
+
+/* Tree of SCHED_FAIR groups with runnable members, by group vruntime */
+static rb_tree_t fairGroups;
+
+/* monotonic lower bound of the groups' virtual runtimes */
+static uint64_t g_fairMinVruntime;
+
+/* Group of SCHED_FAIR threads that were not given one */
+static sched_group_t g_defaultGroup;
+
+/* Runnable SCHED_DEADLINE threads, by absolute deadline */
+static rb_tree_t deadlineTree;
+
+/* admitted SCHED_DEADLINE bandwidth, per mille */
+static unsigned int g_dlTotalUtil;
+
+static void deadlineReplenish(ktimer_t* timer);
+static void waitTimerFired(ktimer_t* timer);
+static void sleepTimerFired(hrtimer_t* timer);
+static void mutexPropagate(mutex_t* mutex);
+
+/* in start.s */
+extern void switchToThread(thread_t*);
+
 /* Queue of sleeping threads */
 static thread_queue_t sleepQueue;
 
@@ -52,8 +85,9 @@ static thread_queue_t reaperWaitQueue;
 /* global, currently-running thread */
 thread_t *g_current_thread = NULL;
 
-/* When set, interrupts will not cause a new thread to be scheduled */
-static volatile bool g_preemption_disabled;
+/* Set when the current thread should be switched away from as soon as
+ * its preemption count allows (e.g. it used up its quantum) */
+volatile int g_need_reschedule = false;
 
 /* Counter for keys that access thread-local data
  * (Based on POSIX threads' thread-specific data) */
@@ -70,30 +104,40 @@ typedef void (thread_launch_func_t)(void);
 static void allThreadsAdd(thread_t* thread) {
     KASSERT(thread);
 
+    mutexLock(&allThreadsLock);
+
     thread->listNext = NULL;
     thread_t **t = &allThreadHead;
     while (*t != NULL) {
         KASSERT(*t != thread);
         t = &(*t)->listNext;
     }
-    *t = thread;
+    /* readers may see the thread as soon as it is linked */
+    rcuAssignPointer(*t, thread);
+
+    mutex_unlock(&allThreadsLock);
 }
 
 /*
- * Remove a thread from the list of all threads
+ * Remove a thread from the list of all threads. Readers may still be
+ * looking at it, so its listNext is left intact and it must not be
+ * freed before a grace period has passed.
  */
 static void allThreadsRemove(thread_t* thread) {
     KASSERT(thread);
 
+    mutexLock(&allThreadsLock);
+
     thread_t** t = &allThreadHead;
     while (*t != NULL) {
         if (thread == *t) {
-            *t = (*t)->listNext;
+            rcuAssignPointer(*t, thread->listNext);
             break;
         }
         t = &(*t)->listNext;
     }
-    thread->listNext = NULL;
+
+    mutex_unlock(&allThreadsLock);
 }
 
 
@@ -104,11 +148,22 @@ void threadQueueClear(thread_queue_t* queue) {
     KASSERT(queue);
     queue->head = NULL;
     queue->tail = NULL;
+    queue->hooks = NULL;
+}
+
+/*
+ * Initialize an empty queue that keeps its threads ordered by
+ * priority (FIFO among equals), so the best waiter is always at
+ * the head. Insertion is O(n), selection O(1).
+ */
+void threadQueueInitPriority(thread_queue_t* queue) {
+    threadQueueClear(queue);
+    queue->prioritized = true;
 }
 
 bool threadQueueEmpty(thread_queue_t* queue) {
     KASSERT(queue);
-    if (queue->head == NULL && queue->tail == NULL) {
+    if (queue->head == NULL && queue->tail == NULL && queue->hooks == NULL) {
         return true;
     }
     return false;
@@ -143,7 +198,16 @@ static void enqueueThread(thread_queue_t* queue, thread_t* thread) {
     /* overkill - make sure thread is not already in queue */
     KASSERT(!containsThread(queue, thread));
 
-    if (NULL == queue->head) {
+    if (queue->prioritized && queue->head != NULL &&
+            queue->tail->priority < thread->priority) {
+        /* goes in front of the first thread of lower priority */
+        thread_t** t = &queue->head;
+        while ((*t)->priority >= thread->priority) {
+            t = &(*t)->queueNext;
+        }
+        thread->queueNext = *t;
+        *t = thread;
+    } else if (NULL == queue->head) {
         KASSERT(NULL == queue->tail);
         queue->head = thread;
         queue->tail = thread;
@@ -245,12 +309,19 @@ static void initThread(thread_t* thread, void* stackPage, void* userStackPage, p
             (uintptr_t)userStackPage + PAGE_SIZE : 0;
 
     thread->priority = priority;
+    thread->basePriority = priority;
+    thread->weight = FAIR_WEIGHT_DEFAULT;
+    ktimerInit(&thread->dlTimer, deadlineReplenish, thread);
+    ktimerInit(&thread->waitTimer, waitTimerFired, thread);
+    hrtimerInit(&thread->sleepTimer, sleepTimerFired, thread);
+    thread->timerSlack = (g_current_thread != NULL) ?
+            g_current_thread->timerSlack : TIMER_SLACK_DEFAULT;
     thread->owner = detached ? NULL : g_current_thread;
 
     thread->refCount = detached ? 1 : 2;
     thread->alive = true;
 
-    threadQueueClear(&thread->joinQueue);
+    completionInit(&thread->exited);
 
     DEBUGF("new thread @ 0x%X, id: %d, esp: %X\n", thread, thread->id, thread->esp, thread->userEsp);
 }
@@ -292,12 +363,9 @@ static thread_t* createThread(unsigned int priority, bool detached, bool usermod
     return thread;
 }
 
-/*
- * Perform all necessary cleanup and destroy thread.
- * call with interrupts enabled.
- */
-static void destroyThread(thread_t* thread) {
-    KASSERT(thread);
+static void freeThread(rcu_head_t* head) {
+    thread_t* thread = RCU_ENTRY(head, thread_t, rcu);
+
     cli();
 
     freePage(thread->stackBase);
@@ -306,11 +374,21 @@ static void destroyThread(thread_t* thread) {
     }
     freePage(thread);
 
-    allThreadsRemove(thread);
-
     sti();
 }
 
+/*
+ * Perform all necessary cleanup and destroy thread.
+ * The memory is freed once list readers are done with it.
+ * call with interrupts enabled.
+ */
+static void destroyThread(thread_t* thread) {
+    KASSERT(thread);
+
+    allThreadsRemove(thread);
+    callRcu(&thread->rcu, freeThread);
+}
+
 /*
  * pass thread to reaper for destruction
  * must be called with interrupts disabled
@@ -320,7 +398,7 @@ static void reapThread(thread_t* thread) {
     KASSERT(thread);
     DEBUGF("reaping thread %d\n", thread->id);
     enqueueThread(&graveyardQueue, thread);
-    wakeAll(&reaperWaitQueue);
+    wakeUp(&reaperWaitQueue, 1);
 }
 
 /*
@@ -405,10 +483,7 @@ static void setupThreadStack(thread_t* thread,
         *--esp = (int)launchKernelThread;
     }
 
-    /* push general registers */
-    *--esp = 0;     /* eax */
-    *--esp = 0;     /* ecx */
-    *--esp = 0;     /* edx */
+    /* push callee-saved registers, as switchToThread leaves them */
     *--esp = 0;     /* ebx */
     *--esp = 0;     /* ebp */
     *--esp = 0;     /* esi */
@@ -435,8 +510,19 @@ static void reaper(uint32_t arg) {
     while (true) {
         /* check if any threads need disposal */
         if ((thread = graveyardQueue.head) == NULL) {
-            /* graveyard empty... wait for thread to die */
-            wait(&reaperWaitQueue);
+            if (!rcuCallbacksPending()) {
+                /* nothing to do... wait for thread to die */
+                waitExclusive(&reaperWaitQueue);
+                continue;
+            }
+
+            /* free what RCU readers are done with; if nothing is
+             * ready yet, let the grace period pass */
+            sti();
+            if (rcuRunCallbacks() == 0) {
+                yield();
+            }
+            cli();
         } else {
             /* empty the graveyard queue */
             threadQueueClear(&graveyardQueue);
@@ -460,254 +546,1340 @@ static void reaper(uint32_t arg) {
 }
 
 /*
- * Wake up any threads that are finished sleeping
+ * Wake the reaper to run RCU callbacks.
+ * May be called from interrupt handlers.
  */
-void wakeSleepers(void) {
-    thread_t* next = NULL;
-    thread_t* thread = sleepQueue.head;
-
-    while (thread) {
-        /* DEBUGF("attempting to wake thread %d\n", thread->id); */
-        next = thread->queueNext;
-        if (getTicks() >= thread->sleepUntil) {
-            /* DEBUGF("waking thread %d (%u >= %u)\n", */
-                    /* thread->id, getTicks(), thread->sleepUntil); */
-            thread->sleepUntil = 0;
-            /* time to wake up this sleeping thread...
-             * so remove it from sleep queue and make it runnable */
-            dequeueThread(&sleepQueue, thread); /* FIXME - dumb inefficient */
-            makeRunnable(thread);
-        } else {
-            /* DEBUGF("thread %d still sleeping (%u < %u)\n", */
-                    /* thread->id, getTicks(), thread->sleepUntil); */
-        }
-        thread = next;
-    }
+void wakeReaper(void) {
+    bool iFlag = begIntAtomic();
+    wakeUp(&reaperWaitQueue, 1);
+    endIntAtomic(iFlag);
 }
 
 /*
- * Find best candidate thread in a thread queue.
- *
- * This currently returns the head of the thread queue,
- * so the scheduling algorithm is essentially FIFO
+ * The waiter to wake first: the oldest one, which for a prioritized
+ * queue is also the one with the highest priority
  */
 static thread_t* findBest(thread_queue_t* queue) {
     KASSERT(queue);
     return queue->head;
 }
 
-thread_t* getNextRunnable(void) {
-    thread_t* best = findBest(&runQueue);
-    KASSERT(best);
-    dequeueThread(&runQueue, best);
+/*
+ * Find the highest-priority thread in a thread queue.
+ * Threads of equal priority are picked in FIFO order.
+ */
+static thread_t* findHighestPriority(thread_queue_t* queue) {
+    KASSERT(queue);
 
+    thread_t* best = queue->head;
+    for (thread_t* cur = queue->head; cur != NULL; cur = cur->queueNext) {
+        if (cur->priority > best->priority) {
+            best = cur;
+        }
+    }
     return best;
 }
 
-
 /*
- * Determine a new key and set the destructor for thread-local data.
- *
- * @returns true on success, false on failure (no more keys)
+ * Scheduling class a thread is handled by: its policy, except that
+ * a thread boosted by priority inheritance is scheduled by priority
+ * until the boost is dropped. Deadline threads are never boosted.
  */
-bool tlocalCreate(tlocal_key_t* key, tlocal_destructor_t destructor) {
-    KASSERT(key);
+static inline sched_policy_t schedClass(thread_t* thread) {
+    if (thread->priority > thread->basePriority && thread->policy != SCHED_DEADLINE) {
+        return SCHED_PRIORITY;
+    }
+    return thread->policy;
+}
 
-    bool iFlag = begIntAtomic();
+/*
+ * MLFQ level of a thread. Levels from before the last boost
+ * are stale and mean level 0.
+ */
+static unsigned int mlfqLevel(thread_t* thread) {
+    if (thread->mlfqEpoch != g_mlfqEpoch) {
+        thread->mlfqEpoch = g_mlfqEpoch;
+        thread->mlfqLevel = 0;
+    }
+    return thread->mlfqLevel;
+}
 
-    if (tlocalKeyCounter >= MAX_TLOCAL_KEYS) {
-        return false;
+/*
+ * Number of ticks a thread may run before it is preempted
+ */
+static unsigned int threadQuantum(thread_t* thread) {
+    if (schedClass(thread) == SCHED_MLFQ) {
+        return MLFQ_BASE_QUANTUM << mlfqLevel(thread);
     }
+    return THREAD_QUANTUM;
+}
 
-    tlocalDestructors[tlocalKeyCounter] = destructor;
-    *key = tlocalKeyCounter++;
+/*
+ * Move every runnable MLFQ thread back to level 0. Blocked threads
+ * pick up the boost lazily through the epoch in mlfqLevel().
+ */
+static void mlfqBoost(void) {
+    KASSERT(!interruptsEnabled());
 
-    endIntAtomic(iFlag);
+    ++g_mlfqEpoch;
+    g_mlfqBoostTicks = 0;
 
-    return true;
+    thread_queue_t* top = &mlfqQueues[0];
+    for (int level = 1; level < MLFQ_LEVELS; ++level) {
+        thread_queue_t* queue = &mlfqQueues[level];
+        if (queue->head == NULL) {
+            continue;
+        }
+        if (top->head == NULL) {
+            top->head = queue->head;
+        } else {
+            top->tail->queueNext = queue->head;
+        }
+        top->tail = queue->tail;
+        queue->head = NULL;
+        queue->tail = NULL;
+    }
 }
 
-void tlocalSet(tlocal_key_t key, const void* data) {
-    KASSERT(key < tlocalKeyCounter);
-    g_current_thread->tlocalData[key] = data;
+/* wrap-safe comparison of virtual runtimes */
+static inline bool vruntimeBefore(uint64_t a, uint64_t b) {
+    return (int64_t)(a - b) < 0;
 }
 
-void* tlocalGet(tlocal_key_t key) {
-    KASSERT(key < tlocalKeyCounter);
-    return (void*)g_current_thread->tlocalData[key];
+static inline uint64_t vruntimeMax(uint64_t a, uint64_t b) {
+    return vruntimeBefore(a, b) ? b : a;
 }
 
+static bool threadVruntimeLess(rb_node_t* a, rb_node_t* b) {
+    return vruntimeBefore(RB_ENTRY(a, thread_t, fairNode)->vruntime,
+            RB_ENTRY(b, thread_t, fairNode)->vruntime);
+}
 
-void yield(void) {
-    KASSERT(g_current_thread);
-    cli();
-    makeRunnable(g_current_thread);
-    schedule();
-    sti();
+static bool groupVruntimeLess(rb_node_t* a, rb_node_t* b) {
+    return vruntimeBefore(RB_ENTRY(a, sched_group_t, node)->vruntime,
+            RB_ENTRY(b, sched_group_t, node)->vruntime);
+}
+
+static sched_group_t* fairGroupOf(thread_t* thread) {
+    return (thread->group != NULL) ? thread->group : &g_defaultGroup;
 }
 
 /*
- * Exit current thread and initiate a context switch
+ * Put a group with runnable members into the tree of groups, unless
+ * one of its members is running (its vruntime is changing then)
+ * or it has used up its quota.
  */
-void exit(int exitCode) {
-    thread_t* current = g_current_thread;
-    KASSERT(current);
+static void fairQueueGroup(sched_group_t* group) {
+    if (group->queued || group->running || group->throttled ||
+            rbEmpty(&group->runnable)) {
+        return;
+    }
 
-    if (interruptsEnabled()) {
-        cli();
+    /* a group coming back from idle gets no credit for the idle time */
+    group->vruntime = vruntimeMax(group->vruntime,
+            g_fairMinVruntime - FAIR_SLEEPER_CREDIT);
+
+    rbInsert(&fairGroups, &group->node);
+    group->queued = true;
+}
+
+static void fairUnqueueGroup(sched_group_t* group) {
+    if (group->queued) {
+        rbRemove(&fairGroups, &group->node);
+        group->queued = false;
     }
+}
 
-    current->exitCode = exitCode;
-    current->alive = false;
+static void fairEnqueue(thread_t* thread) {
+    sched_group_t* group = fairGroupOf(thread);
 
-    /* clean up thread-local data */
-    tlocalExit(current);
+    /* likewise, a thread waking from a long sleep gets only a little credit */
+    thread->vruntime = vruntimeMax(thread->vruntime,
+            group->minVruntime - FAIR_SLEEPER_CREDIT);
 
-    /* notify thread's possible owner */
-    wakeAll(&current->joinQueue);
+    rbInsert(&group->runnable, &thread->fairNode);
+    fairQueueGroup(group);
+}
 
-    /* remove thread's implicit reference to itself */
-    detachThread(current);
+static void fairDequeue(thread_t* thread) {
+    sched_group_t* group = fairGroupOf(thread);
 
-    schedule();
+    rbRemove(&group->runnable, &thread->fairNode);
+    if (rbEmpty(&group->runnable)) {
+        fairUnqueueGroup(group);
+    }
+}
 
-    /* This thread will never be scheduled again, so it should
-     * never get to this point */
-    KASSERT(false);
+/*
+ * Leftmost thread of the leftmost group, in O(1)
+ */
+static thread_t* fairPeek(void) {
+    rb_node_t* node = rbFirst(&fairGroups);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    sched_group_t* group = RB_ENTRY(node, sched_group_t, node);
+    return RB_ENTRY(rbFirst(&group->runnable), thread_t, fairNode);
+}
+
+/* a SCHED_FAIR thread becomes the current thread */
+static void fairStart(thread_t* thread) {
+    sched_group_t* group = fairGroupOf(thread);
+    fairUnqueueGroup(group);
+    group->running = true;
+}
+
+/* a SCHED_FAIR thread stops being the current thread */
+static void fairStop(thread_t* thread) {
+    sched_group_t* group = fairGroupOf(thread);
+    group->running = false;
+    fairQueueGroup(group);
 }
 
 /*
- * Wait for a thread to die.
- * Interrupts must be enabled.
- *
- * @returns thread exit code
+ * Charge a tick to the current SCHED_FAIR thread and its group
  */
-int join(thread_t* thread) {
-    KASSERT(interruptsEnabled());
+static void fairTick(thread_t* current) {
+    sched_group_t* group = fairGroupOf(current);
 
-    KASSERT(thread);
-    /* only the owner can join on a thread */
-    KASSERT(thread->owner = g_current_thread);
+    current->vruntime += FAIR_TICK_SCALE / current->weight;
+    group->vruntime += FAIR_TICK_SCALE / group->weight;
 
-    cli();
+    if (group->quota > 0) {
+        /* the period starts with the first tick used in it */
+        if (!group->periodTimer.pending) {
+            ktimerSet(&group->periodTimer, getTicks() + group->period);
+        }
+        if (++group->used >= group->quota && !group->throttled) {
+            /* parked by fairStop() when the current thread is switched out */
+            group->throttled = true;
+            g_need_reschedule = true;
+        }
+    }
 
-    while (thread->alive) {
-        wait(&thread->joinQueue);
+    /* advance the lower bounds used to place waking threads/groups */
+    uint64_t min = current->vruntime;
+    rb_node_t* first = rbFirst(&group->runnable);
+    if (first != NULL) {
+        uint64_t v = RB_ENTRY(first, thread_t, fairNode)->vruntime;
+        if (vruntimeBefore(v, min)) {
+            min = v;
+        }
+    }
+    group->minVruntime = vruntimeMax(group->minVruntime, min);
+
+    min = group->vruntime;
+    first = rbFirst(&fairGroups);
+    if (first != NULL) {
+        uint64_t v = RB_ENTRY(first, sched_group_t, node)->vruntime;
+        if (vruntimeBefore(v, min)) {
+            min = v;
+        }
     }
+    g_fairMinVruntime = vruntimeMax(g_fairMinVruntime, min);
+}
 
-    int exitcode = thread->exitCode;
+/* wrap-safe comparison of tick counts */
+static inline bool ticksBefore(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
 
-    /* release reference to thread */
-    detachThread(thread);
+static bool deadlineLess(rb_node_t* a, rb_node_t* b) {
+    return ticksBefore(RB_ENTRY(a, thread_t, dlNode)->dlAbsDeadline,
+            RB_ENTRY(b, thread_t, dlNode)->dlAbsDeadline);
+}
 
-    sti();
+static inline unsigned int deadlineUtil(thread_t* thread) {
+    return thread->dlRuntime * 1000 / thread->dlDeadline;
+}
 
-    return exitcode;
+/* start a new period at `release` with a full budget */
+static void deadlineNewPeriod(thread_t* thread, uint32_t release) {
+    thread->dlRelease = release;
+    thread->dlAbsDeadline = release + thread->dlDeadline;
+    thread->dlBudget = thread->dlRuntime;
 }
 
-/*
- * Places a thread on the sleep queue.
- * The thread will not become runnable until `ticks`
- * number of timer ticks have passed from the time
- * `sleep` is called.
- */
-void sleep(unsigned int milliseconds) {
-    KASSERT(g_current_thread);
+static void deadlineEnqueue(thread_t* thread) {
+    uint32_t now = getTicks();
+
+    /*
+     * A thread waking up keeps its current deadline only if the budget
+     * left can be used up by then without exceeding its bandwidth;
+     * otherwise it would steal time from the other deadline threads,
+     * so it starts a new period (constant bandwidth server rule).
+     */
+    if (!thread->dlThrottled) {
+        if (!ticksBefore(now, thread->dlAbsDeadline) ||
+                (uint64_t)thread->dlBudget * thread->dlDeadline >
+                (uint64_t)(thread->dlAbsDeadline - now) * thread->dlRuntime) {
+            deadlineNewPeriod(thread, now);
+        }
+    }
 
-    unsigned int ticks = milliseconds * TICKS_PER_SEC / 1000;
-    if (ticks < 1) { ticks = 1; }
+    /* a throttled thread stays runnable, but only enters the tree
+     * once its budget is replenished */
+    if (!thread->dlThrottled) {
+        rbInsert(&deadlineTree, &thread->dlNode);
+        thread->dlQueued = true;
+    }
+}
 
-    bool iFlag = begIntAtomic();
-    g_current_thread->sleepUntil = getTicks() + ticks;
-    KASSERT(!interruptsEnabled());
-    enqueueThread(&sleepQueue, g_current_thread);
-    /* DEBUGF("thread %d sleeping until %u\n", g_current_thread->id, */
-            /* g_current_thread->sleepUntil); */
-    schedule();
-    endIntAtomic(iFlag);
+static void deadlineDequeue(thread_t* thread) {
+    if (thread->dlQueued) {
+        rbRemove(&deadlineTree, &thread->dlNode);
+        thread->dlQueued = false;
+    }
 }
 
 /*
- * Place current thread on a wait queue
- * Called with interrupts disabled.
+ * The budget of a throttled thread is used up: keep it off the CPU
+ * until its next period starts.
  */
-void wait(thread_queue_t* waitQueue) {
-    KASSERT(!interruptsEnabled());
-    KASSERT(waitQueue);
-    KASSERT(g_current_thread);
+static void deadlineThrottle(thread_t* thread) {
+    thread->dlThrottled = true;
+    thread->dlBudget = 0;
+    ktimerSet(&thread->dlTimer, thread->dlRelease + thread->dlPeriod);
+}
 
-    enqueueThread(waitQueue, g_current_thread);
+static thread_queue_t* runQueueOf(thread_t* thread) {
+    if (schedClass(thread) == SCHED_MLFQ) {
+        return &mlfqQueues[mlfqLevel(thread)];
+    }
+    return &runQueue;
+}
 
-    schedule();
+static void enqueueRunnable(thread_t* thread) {
+    if (schedClass(thread) == SCHED_DEADLINE) {
+        deadlineEnqueue(thread);
+    } else if (schedClass(thread) == SCHED_FAIR) {
+        fairEnqueue(thread);
+    } else {
+        enqueueThread(runQueueOf(thread), thread);
+    }
+    thread->onRunQueue = true;
+}
+
+static void dequeueRunnable(thread_t* thread) {
+    if (schedClass(thread) == SCHED_DEADLINE) {
+        deadlineDequeue(thread);
+    } else if (schedClass(thread) == SCHED_FAIR) {
+        fairDequeue(thread);
+    } else {
+        dequeueThread(runQueueOf(thread), thread);
+    }
+    thread->onRunQueue = false;
 }
 
 /*
- * Wake up all threads waiting on a wait queue.
- * Called with interrupts disabled.
+ * Take a thread off its scheduling class before changing its
+ * scheduling parameters.
+ *
+ * @returns whether it was on a run queue
  */
-void wakeAll(thread_queue_t* waitQueue) {
-    thread_t* thread = waitQueue->head;
-    thread_t* next = NULL;
+static bool schedDetach(thread_t* thread) {
+    KASSERT(!interruptsEnabled());
 
-    while (thread) {
-        next = thread->queueNext;
-        makeRunnable(thread);
-        thread = next;
+    bool queued = thread->onRunQueue;
+    if (queued) {
+        dequeueRunnable(thread);
     }
-
-    threadQueueClear(waitQueue);
+    if (thread == g_current_thread && schedClass(thread) == SCHED_FAIR) {
+        fairStop(thread);
+    }
+    return queued;
 }
 
-/*
- * Wake up (one) thread that is the best candidate for running
- */
-void wakeOne(thread_queue_t* waitQueue) {
+static void schedAttach(thread_t* thread, bool queued) {
     KASSERT(!interruptsEnabled());
-    thread_t* best = findBest(waitQueue);
-    if (best != NULL) {
-        dequeueThread(waitQueue, best);
-        makeRunnable(best);
+
+    if (thread == g_current_thread && schedClass(thread) == SCHED_FAIR) {
+        fairStart(thread);
+    }
+    if (queued) {
+        enqueueRunnable(thread);
     }
 }
 
 /*
- * Add thread to run queue so it will be scheduled
+ * Rank of a thread's scheduling class:
+ * deadline threads run first, then SCHED_PRIORITY threads above
+ * PRIORITY_IDLE, then MLFQ threads, then fair share threads,
+ * then the idle thread.
  */
-void makeRunnable(thread_t* thread) {
-    KASSERT(!interruptsEnabled());
-    KASSERT(thread);
-    enqueueThread(&runQueue, thread);
+static int classRank(thread_t* thread) {
+    if (schedClass(thread) == SCHED_DEADLINE) {
+        return 4;
+    }
+    if (schedClass(thread) == SCHED_MLFQ) {
+        return 2;
+    }
+    if (schedClass(thread) == SCHED_FAIR) {
+        return 1;
+    }
+    return (thread->priority > PRIORITY_IDLE) ? 3 : 0;
 }
 
 /*
- * Assumes interrupts are enabled before
- * atomically making thread runnable
+ * Should `thread` run before `current`?
  */
-void makeRunnableAtomic(thread_t* thread) {
-    KASSERT(thread);
-
-    cli();
-    makeRunnable(thread);
-    sti();
+static bool runsBefore(thread_t* thread, thread_t* current) {
+    int rank = classRank(thread), currentRank = classRank(current);
+    if (rank != currentRank) {
+        return rank > currentRank;
+    }
+    if (schedClass(thread) == SCHED_DEADLINE) {
+        return ticksBefore(thread->dlAbsDeadline, current->dlAbsDeadline);
+    }
+    if (schedClass(thread) == SCHED_MLFQ) {
+        return mlfqLevel(thread) < mlfqLevel(current);
+    }
+    if (schedClass(thread) == SCHED_FAIR) {
+        sched_group_t* group = fairGroupOf(thread);
+        sched_group_t* currentGroup = fairGroupOf(current);
+        if (group->throttled) {
+            return false;
+        }
+        if (group != currentGroup) {
+            return vruntimeBefore(group->vruntime + FAIR_WAKEUP_GRAN,
+                    currentGroup->vruntime);
+        }
+        return vruntimeBefore(thread->vruntime + FAIR_WAKEUP_GRAN,
+                current->vruntime);
+    }
+    return thread->priority > current->priority;
 }
 
 /*
- * Schedule a runnable thread.
- * Called with interrupts disabled.
- * g_current_thread should already be place on another
- * queue (or left on run queue)
+ * The thread getNextRunnable() would pick, left on its run queue
+ * (NULL if none is runnable)
  */
-extern void switchToThread(thread_t*);
-void schedule(void) {
-    KASSERT(!interruptsEnabled());
-    KASSERT(!g_preemption_disabled);
+static thread_t* peekNextRunnable(void) {
+    rb_node_t* earliest = rbFirst(&deadlineTree);
+    if (earliest != NULL) {
+        return RB_ENTRY(earliest, thread_t, dlNode);
+    }
 
-    wakeSleepers();
+    thread_t* best = findHighestPriority(&runQueue);
 
-    thread_t* runnable = getNextRunnable();
+    if (best == NULL || best->priority == PRIORITY_IDLE) {
+        for (int level = 0; level < MLFQ_LEVELS; ++level) {
+            if (mlfqQueues[level].head != NULL) {
+                best = mlfqQueues[level].head;
+                break;
+            }
+        }
+    }
 
-    KASSERT(runnable);
-    KASSERT(g_current_thread);
+    if (best == NULL || best->priority == PRIORITY_IDLE) {
+        thread_t* fair = fairPeek();
+        if (fair != NULL) {
+            best = fair;
+        }
+    }
+
+    return best;
+}
+
+thread_t* getNextRunnable(void) {
+    thread_t* best = peekNextRunnable();
+
+    KASSERT(best);
+    dequeueRunnable(best);
+
+    if (schedClass(best) == SCHED_FAIR) {
+        fairStart(best);
+    }
+
+    return best;
+}
+
+/*
+ * An MLFQ thread that gives up the CPU before its quantum ends is
+ * treated as interactive and moves up a level.
+ */
+static void mlfqCreditEarlyRelease(thread_t* thread) {
+    if (schedClass(thread) == SCHED_MLFQ && thread->alive &&
+            thread->numTicks < threadQuantum(thread) && mlfqLevel(thread) > 0) {
+        --thread->mlfqLevel;
+    }
+}
+
+/*
+ * Per-tick scheduler accounting, called from the timer interrupt.
+ * Requests a reschedule once the current thread outlived its quantum.
+ * The switch happens on return from the interrupt, or later if the
+ * thread has preemption disabled.
+ */
+void schedulerTick(void) {
+    KASSERT(!interruptsEnabled());
+
+    if (++g_mlfqBoostTicks >= MLFQ_BOOST_TICKS) {
+        mlfqBoost();
+    }
+
+    thread_t* current = g_current_thread;
+    if (current == NULL) {
+        return;
+    }
+
+    if (schedClass(current) == SCHED_FAIR) {
+        fairTick(current);
+    }
+
+    if (schedClass(current) == SCHED_DEADLINE && !current->dlThrottled) {
+        if (--current->dlBudget == 0) {
+            deadlineThrottle(current);
+            g_need_reschedule = true;
+        }
+        return;
+    }
+
+    unsigned int quantum = threadQuantum(current);
+    if (++current->numTicks > quantum) {
+        /* burned its whole quantum: demote once */
+        if (schedClass(current) == SCHED_MLFQ && current->numTicks == quantum + 1 &&
+                mlfqLevel(current) < MLFQ_LEVELS - 1) {
+            ++current->mlfqLevel;
+        }
+        g_need_reschedule = true;
+    }
+}
+
+/*
+ * Give up the thread's deadline bandwidth.
+ * Called with interrupts disabled.
+ */
+static void deadlineLeave(thread_t* thread) {
+    KASSERT(!interruptsEnabled());
+
+    ktimerCancel(&thread->dlTimer);
+    thread->dlThrottled = false;
+    g_dlTotalUtil -= deadlineUtil(thread);
+}
+
+/*
+ * Timer callback: a throttled thread's next period has started.
+ */
+static void deadlineReplenish(ktimer_t* timer) {
+    thread_t* thread = timer->data;
+    KASSERT(thread->policy == SCHED_DEADLINE);
+
+    thread->dlThrottled = false;
+
+    /* if it was throttled for longer than a period, catch up */
+    uint32_t release = thread->dlRelease + thread->dlPeriod;
+    if (ticksBefore(release + thread->dlPeriod, getTicks())) {
+        release = getTicks();
+    }
+    deadlineNewPeriod(thread, release);
+
+    if (thread->onRunQueue) {
+        /* runnable all along: put it back in the tree */
+        dequeueRunnable(thread);
+        makeRunnable(thread);
+    }
+}
+
+/*
+ * Change the scheduling policy of a thread to any policy but
+ * SCHED_DEADLINE (use setSchedDeadline for that).
+ * MLFQ threads start out at level 0.
+ */
+void setSchedPolicy(thread_t* thread, sched_policy_t policy) {
+    KASSERT(thread);
+    KASSERT(policy != SCHED_DEADLINE);
+
+    bool iFlag = begIntAtomic();
+
+    bool queued = schedDetach(thread);
+
+    if (thread->policy == SCHED_DEADLINE) {
+        deadlineLeave(thread);
+    }
+
+    if (policy == SCHED_FAIR && thread->policy != SCHED_FAIR) {
+        thread->vruntime = fairGroupOf(thread)->minVruntime;
+    }
+    thread->policy = policy;
+    thread->mlfqEpoch = g_mlfqEpoch;
+    thread->mlfqLevel = 0;
+
+    schedAttach(thread, queued);
+
+    endIntAtomic(iFlag);
+}
+
+/*
+ * Make a thread SCHED_DEADLINE: every `period` milliseconds it may run
+ * for `runtime` milliseconds, which it gets within `deadline`
+ * milliseconds from the start of the period.
+ * Can also be used to change the parameters of a deadline thread.
+ *
+ * @returns false if the parameters are invalid, or admitting the
+ *          thread would exceed the deadline bandwidth (DL_MAX_UTIL)
+ */
+bool setSchedDeadline(thread_t* thread, unsigned int runtime, unsigned int deadline, unsigned int period) {
+    KASSERT(thread);
+
+    uint32_t runtimeTicks = msecsToTicks(runtime);
+    uint32_t deadlineTicks = msecsToTicks(deadline);
+    uint32_t periodTicks = msecsToTicks(period);
+
+    /* msecsToTicks() rounds up to at least a tick, so none are 0 */
+    if (runtimeTicks > deadlineTicks || deadlineTicks > periodTicks) {
+        return false;
+    }
+
+    unsigned int util = runtimeTicks * 1000 / deadlineTicks;
+
+    bool iFlag = begIntAtomic();
+
+    unsigned int oldUtil = (thread->policy == SCHED_DEADLINE) ? deadlineUtil(thread) : 0;
+    if (g_dlTotalUtil - oldUtil + util > DL_MAX_UTIL) {
+        endIntAtomic(iFlag);
+        return false;
+    }
+
+    bool queued = schedDetach(thread);
+
+    if (thread->policy == SCHED_DEADLINE) {
+        deadlineLeave(thread);
+    }
+
+    g_dlTotalUtil += util;
+    thread->policy = SCHED_DEADLINE;
+    thread->dlRuntime = runtimeTicks;
+    thread->dlDeadline = deadlineTicks;
+    thread->dlPeriod = periodTicks;
+    deadlineNewPeriod(thread, getTicks());
+
+    schedAttach(thread, queued);
+
+    /* may now have to run before the current thread, or stop being it */
+    thread_t* current = g_current_thread;
+    if (thread == current || (queued && runsBefore(thread, current))) {
+        g_need_reschedule = true;
+    }
+
+    endIntAtomic(iFlag);
+
+    return true;
+}
+
+/*
+ * Called by a SCHED_DEADLINE thread when it is done with the work of
+ * the current period: gives up the rest of the budget and sleeps
+ * until the next period starts. This releases periodic threads at
+ * fixed instants, independent of how long each job took.
+ */
+void waitNextPeriod(void) {
+    thread_t* current = g_current_thread;
+    KASSERT(current);
+    KASSERT(current->policy == SCHED_DEADLINE);
+
+    cli();
+
+    if (!current->dlThrottled) {
+        deadlineThrottle(current);
+    }
+    makeRunnable(current);
+    schedule();
+
+    sti();
+}
+
+/*
+ * Timer callback: a group's quota period is over, so its members
+ * may run again.
+ */
+static void schedGroupRefill(ktimer_t* timer) {
+    sched_group_t* group = timer->data;
+
+    group->used = 0;
+    if (!group->throttled) {
+        return;
+    }
+
+    group->throttled = false;
+    fairQueueGroup(group);
+
+    thread_t* first = fairPeek();
+    if (first != NULL && fairGroupOf(first) == group &&
+            runsBefore(first, g_current_thread)) {
+        g_need_reschedule = true;
+    }
+}
+
+/*
+ * Initialize a group of SCHED_FAIR threads. The group must stay
+ * allocated as long as it has members.
+ */
+void schedGroupInit(sched_group_t* group, const char* name, unsigned int weight) {
+    KASSERT(group);
+
+    memset(group, 0, sizeof(sched_group_t));
+    group->name = name;
+    group->weight = (weight > 0) ? weight : FAIR_WEIGHT_DEFAULT;
+    rbInit(&group->runnable, threadVruntimeLess);
+    ktimerInit(&group->periodTimer, schedGroupRefill, group);
+
+    bool iFlag = begIntAtomic();
+    group->vruntime = g_fairMinVruntime;
+    endIntAtomic(iFlag);
+}
+
+/*
+ * Limit a group to `quota` milliseconds of CPU time every `period`
+ * milliseconds (quota 0 removes the limit).
+ * Usage is accounted from the timer tick, so the limit has tick
+ * granularity.
+ */
+void schedGroupSetQuota(sched_group_t* group, unsigned int quota, unsigned int period) {
+    KASSERT(group);
+    KASSERT(quota == 0 || quota <= period);
+
+    bool iFlag = begIntAtomic();
+
+    group->quota = (quota > 0) ? msecsToTicks(quota) : 0;
+    group->period = msecsToTicks(period);
+
+    /* start over with a fresh period */
+    ktimerCancel(&group->periodTimer);
+    schedGroupRefill(&group->periodTimer);
+
+    endIntAtomic(iFlag);
+}
+
+/*
+ * Move a thread to another group (NULL for the default group).
+ * Only matters while the thread is SCHED_FAIR.
+ */
+void setSchedGroup(thread_t* thread, sched_group_t* group) {
+    KASSERT(thread);
+
+    bool iFlag = begIntAtomic();
+
+    bool queued = schedDetach(thread);
+
+    thread->group = group;
+    /* vruntimes of different groups are unrelated; start from the new floor */
+    thread->vruntime = fairGroupOf(thread)->minVruntime;
+
+    schedAttach(thread, queued);
+
+    endIntAtomic(iFlag);
+}
+
+/*
+ * Let the thread's sleeps end up to `slack` nanoseconds late (or more
+ * for long sleeps, see TIMER_SLACK_DIVISOR), so their wakeups can share
+ * a timer interrupt with others. Periodic background work can take
+ * milliseconds; 0 asks for wakeups as exact as possible.
+ * Takes effect from the thread's next sleep.
+ */
+void setTimerSlack(thread_t* thread, uint64_t slack) {
+    KASSERT(thread);
+    bool iFlag = begIntAtomic();
+    thread->timerSlack = slack;
+    endIntAtomic(iFlag);
+}
+
+void setFairWeight(thread_t* thread, unsigned int weight) {
+    KASSERT(thread);
+    KASSERT(weight > 0);
+
+    bool iFlag = begIntAtomic();
+    bool queued = schedDetach(thread);
+    thread->weight = weight;
+    schedAttach(thread, queued);
+    endIntAtomic(iFlag);
+}
+
+
+/*
+ * Determine a new key and set the destructor for thread-local data.
+ *
+ * @returns true on success, false on failure (no more keys)
+ */
+bool tlocalCreate(tlocal_key_t* key, tlocal_destructor_t destructor) {
+    KASSERT(key);
+
+    bool iFlag = begIntAtomic();
+
+    if (tlocalKeyCounter >= MAX_TLOCAL_KEYS) {
+        return false;
+    }
+
+    tlocalDestructors[tlocalKeyCounter] = destructor;
+    *key = tlocalKeyCounter++;
+
+    endIntAtomic(iFlag);
+
+    return true;
+}
+
+void tlocalSet(tlocal_key_t key, const void* data) {
+    KASSERT(key < tlocalKeyCounter);
+    g_current_thread->tlocalData[key] = data;
+}
+
+void* tlocalGet(tlocal_key_t key) {
+    KASSERT(key < tlocalKeyCounter);
+    return (void*)g_current_thread->tlocalData[key];
+}
+
+
+void yield(void) {
+    KASSERT(g_current_thread);
+    cli();
+    makeRunnable(g_current_thread);
+    schedule();
+    sti();
+}
+
+/*
+ * Can a runnable thread be switched to right now?
+ * (throttled threads stay on the run queue but may not run)
+ */
+static bool canRunNow(thread_t* thread) {
+    if (!thread->onRunQueue) {
+        return false;
+    }
+    if (schedClass(thread) == SCHED_DEADLINE) {
+        return !thread->dlThrottled;
+    }
+    if (schedClass(thread) == SCHED_FAIR) {
+        return !fairGroupOf(thread)->throttled;
+    }
+    return true;
+}
+
+/*
+ * Directed yield: switch straight to `thread`, skipping run queue
+ * selection, and hand it the rest of the current thread's time slice.
+ * Meant for a thread that has just woken `thread` (e.g. with the
+ * result of wakeOne) and is about to block waiting for its reply.
+ * The current thread stays runnable.
+ *
+ * Falls back to a plain yield if `thread` cannot run right now, or if
+ * another runnable thread should run before it (a deadline thread, a
+ * higher class or priority), so the handoff never jumps the order the
+ * scheduler would pick in. Does nothing while preemption is disabled.
+ * Must not be called from interrupt handlers.
+ */
+void yieldTo(thread_t* thread) {
+    thread_t* current = g_current_thread;
+    KASSERT(current);
+
+    if (!preemptionEnabled()) {
+        return;
+    }
+
+    bool iFlag = begIntAtomic();
+
+    thread_t* next = (thread != NULL) ? peekNextRunnable() : NULL;
+    if (thread == NULL || thread == current || !canRunNow(thread) ||
+            (next != thread && runsBefore(next, thread))) {
+        makeRunnable(current);
+        schedule();
+        endIntAtomic(iFlag);
+        return;
+    }
+
+    /* the caller is about to block for the wakee's reply, so it is
+     * credited as schedule() credits a thread that blocks */
+    mlfqCreditEarlyRelease(current);
+
+    /* the wakee continues the caller's time slice rather than
+     * starting a fresh one */
+    thread->numTicks = current->numTicks;
+
+    enqueueRunnable(current);
+    if (schedClass(current) == SCHED_FAIR) {
+        fairStop(current);
+    }
+
+    dequeueRunnable(thread);
+    if (schedClass(thread) == SCHED_FAIR) {
+        fairStart(thread);
+    }
+
+    g_need_reschedule = false;
+    rcuQuiescentState();
+    switchToThread(thread);
+
+    endIntAtomic(iFlag);
+}
+
+/*
+ * Exit current thread and initiate a context switch
+ */
+void exit(int exitCode) {
+    thread_t* current = g_current_thread;
+    KASSERT(current);
+
+    if (interruptsEnabled()) {
+        cli();
+    }
+
+    current->exitCode = exitCode;
+    current->alive = false;
+
+    /* clean up thread-local data */
+    tlocalExit(current);
+
+    if (current->policy == SCHED_DEADLINE) {
+        deadlineLeave(current);
+        current->policy = SCHED_PRIORITY;
+    }
+
+    /* notify thread's possible owner */
+    complete(&current->exited);
+
+    /* remove thread's implicit reference to itself */
+    detachThread(current);
+
+    schedule();
+
+    /* This thread will never be scheduled again, so it should
+     * never get to this point */
+    KASSERT(false);
+}
+
+/*
+ * Like join(), but give up after the given number of milliseconds.
+ *
+ * @returns false if the thread is still alive (it is not detached
+ *          then, so it can be joined again); otherwise true, with the
+ *          thread's exit code in *exitCode (if not NULL)
+ */
+bool joinTimeout(thread_t* thread, unsigned int milliseconds, int* exitCode) {
+    KASSERT(interruptsEnabled());
+    KASSERT(thread);
+    KASSERT(thread->owner == g_current_thread);
+
+    if (!waitForCompletionTimeout(&thread->exited, milliseconds)) {
+        return false;
+    }
+
+    cli();
+
+    if (exitCode != NULL) {
+        *exitCode = thread->exitCode;
+    }
+
+    /* release reference to thread */
+    detachThread(thread);
+
+    sti();
+
+    return true;
+}
+
+/*
+ * Wait for a thread to die.
+ * Interrupts must be enabled.
+ *
+ * @returns thread exit code
+ */
+int join(thread_t* thread) {
+    KASSERT(interruptsEnabled());
+
+    KASSERT(thread);
+    /* only the owner can join on a thread */
+    KASSERT(thread->owner = g_current_thread);
+
+    waitForCompletion(&thread->exited);
+
+    cli();
+
+    int exitcode = thread->exitCode;
+
+    /* release reference to thread */
+    detachThread(thread);
+
+    sti();
+
+    return exitcode;
+}
+
+/*
+ * Places a thread on the sleep queue.
+ * The thread will not become runnable until `ticks`
+ * number of timer ticks have passed from the time
+ * `sleep` is called.
+ */
+void sleep(unsigned int milliseconds) {
+    nanosleep((uint64_t)milliseconds * NSEC_PER_MSEC);
+}
+
+static void sleepTimerFired(hrtimer_t* timer) {
+    thread_t* thread = timer->data;
+    dequeueThread(&sleepQueue, thread);
+    makeRunnable(thread);
+}
+
+/*
+ * How late the current thread's sleep of the given length may end.
+ */
+static uint64_t sleepSlack(uint64_t nanoseconds) {
+    uint64_t slack = g_current_thread->timerSlack;
+
+    /* deadline threads are promised their timing */
+    if (slack == 0 || g_current_thread->policy == SCHED_DEADLINE) {
+        return 0;
+    }
+
+    /* a long sleep hardly notices being a little longer; up to a tick
+     * lets its window reach the tick's interrupt */
+    uint64_t scaled = nanoseconds / TIMER_SLACK_DIVISOR;
+    if (scaled > NSEC_PER_SEC / TICKS_PER_SEC) {
+        scaled = NSEC_PER_SEC / TICKS_PER_SEC;
+    }
+    return (scaled > slack) ? scaled : slack;
+}
+
+/*
+ * Sleep for (at least) the given number of nanoseconds. The thread is
+ * woken by its own hrtimer, so the sleep is not rounded up to ticks,
+ * but it may last up to sleepSlack() longer.
+ */
+void nanosleep(uint64_t nanoseconds) {
+    KASSERT(g_current_thread);
+
+    if (nanoseconds == 0) {
+        yield();
+        return;
+    }
+
+    uint64_t slack = sleepSlack(nanoseconds);
+
+    bool iFlag = begIntAtomic();
+    hrtimerStartRange(&g_current_thread->sleepTimer, clockNanos() + nanoseconds, slack);
+    enqueueThread(&sleepQueue, g_current_thread);
+    schedule();
+    endIntAtomic(iFlag);
+}
+
+/*
+ * Place current thread on a wait queue
+ * Called with interrupts disabled.
+ */
+void wait(thread_queue_t* waitQueue) {
+    KASSERT(!interruptsEnabled());
+    KASSERT(waitQueue);
+    KASSERT(g_current_thread);
+
+    g_current_thread->waitQueue = waitQueue;
+    enqueueThread(waitQueue, g_current_thread);
+
+    /* waiting for a mutex: lend our priority to its owner */
+    if (g_current_thread->blockedOn != NULL) {
+        mutexPropagate(g_current_thread->blockedOn);
+    }
+
+    schedule();
+}
+
+/*
+ * Take a thread blocked in wait() off its wait queue and make it
+ * runnable, as if it had been woken, but flagged as aborted.
+ * Called with interrupts disabled.
+ */
+static void abortWait(thread_t* thread) {
+    KASSERT(!interruptsEnabled());
+
+    if (thread->waitQueue == NULL) {
+        return;
+    }
+
+    dequeueThread(thread->waitQueue, thread);
+    thread->waitQueue = NULL;
+    thread->waitAborted = true;
+    makeRunnable(thread);
+}
+
+static void waitTimerFired(ktimer_t* timer) {
+    abortWait(timer->data);
+}
+
+/*
+ * Wait on a queue for at most `ticks` timer ticks.
+ * Must be called with interrupts disabled, like wait().
+ *
+ * @returns true if woken through the queue, false if the time ran out
+ *          or the wait was cancelled with cancelWait()
+ */
+bool waitTimeout(thread_queue_t* waitQueue, uint32_t ticks) {
+    KASSERT(!interruptsEnabled());
+    thread_t* current = g_current_thread;
+    KASSERT(current);
+
+    if (ticks == 0) {
+        return false;
+    }
+
+    current->waitAborted = false;
+    ktimerSet(&current->waitTimer, getTicks() + ticks);
+
+    wait(waitQueue);
+
+    ktimerCancel(&current->waitTimer);
+    return !current->waitAborted;
+}
+
+/*
+ * Wait as an exclusive waiter: of the exclusive waiters on a queue,
+ * wakeUp() wakes only as many as asked for, so an event that only
+ * one waiter can consume does not wake them all.
+ * Must be called with interrupts disabled, like wait().
+ */
+void waitExclusive(thread_queue_t* waitQueue) {
+    KASSERT(g_current_thread);
+
+    g_current_thread->waitExclusive = true;
+    wait(waitQueue);
+    g_current_thread->waitExclusive = false;
+}
+
+bool waitExclusiveTimeout(thread_queue_t* waitQueue, uint32_t ticks) {
+    KASSERT(g_current_thread);
+
+    g_current_thread->waitExclusive = true;
+    bool woken = waitTimeout(waitQueue, ticks);
+    g_current_thread->waitExclusive = false;
+    return woken;
+}
+
+/*
+ * End the wait of a thread blocked in wait() or waitTimeout().
+ * waitTimeout() then returns false; callers of wait() see an ordinary
+ * wakeup and re-check their condition.
+ * Does nothing if the thread is not waiting.
+ */
+void cancelWait(thread_t* thread) {
+    KASSERT(thread);
+
+    bool iFlag = begIntAtomic();
+    abortWait(thread);
+    endIntAtomic(iFlag);
+}
+
+/*
+ * Unregister a hook and run its callback.
+ * Called with interrupts disabled.
+ */
+static void fireHook(wait_hook_t* hook) {
+    KASSERT(!interruptsEnabled());
+    waitHookRemove(hook);
+    hook->func(hook);
+}
+
+/*
+ * Wake up all threads waiting on a wait queue.
+ * Called with interrupts disabled.
+ */
+void wakeAll(thread_queue_t* waitQueue) {
+    thread_t* thread = waitQueue->head;
+    thread_t* next = NULL;
+
+    while (thread) {
+        next = thread->queueNext;
+        thread->waitQueue = NULL;
+        makeRunnable(thread);
+        thread = next;
+    }
+
+    waitQueue->head = NULL;
+    waitQueue->tail = NULL;
+
+    while (waitQueue->hooks != NULL) {
+        fireHook(waitQueue->hooks);
+    }
+}
+
+/*
+ * Wake all non-exclusive waiters, but at most `nrExclusive` of the
+ * exclusive ones (the first ones in queue order). Wait hooks are
+ * treated as non-exclusive.
+ */
+void wakeUp(thread_queue_t* waitQueue, unsigned int nrExclusive) {
+    KASSERT(!interruptsEnabled());
+    KASSERT(waitQueue);
+
+    thread_t* thread = waitQueue->head;
+    while (thread != NULL) {
+        thread_t* next = thread->queueNext;
+
+        bool wake = !thread->waitExclusive;
+        if (!wake && nrExclusive > 0) {
+            --nrExclusive;
+            wake = true;
+        }
+
+        if (wake) {
+            dequeueThread(waitQueue, thread);
+            thread->waitQueue = NULL;
+            makeRunnable(thread);
+        }
+
+        thread = next;
+    }
+
+    while (waitQueue->hooks != NULL) {
+        fireHook(waitQueue->hooks);
+    }
+}
+
+/*
+ * Wake up (one) thread that is the best candidate for running,
+ * or fire the oldest hook if no thread is waiting
+ */
+thread_t* wakeOne(thread_queue_t* waitQueue) {
+    KASSERT(!interruptsEnabled());
+    thread_t* best = findBest(waitQueue);
+    if (best != NULL) {
+        dequeueThread(waitQueue, best);
+        best->waitQueue = NULL;
+        makeRunnable(best);
+    } else if (waitQueue->hooks != NULL) {
+        fireHook(waitQueue->hooks);
+    }
+    return best;
+}
+
+void waitHookInit(wait_hook_t* hook, wait_hook_func_t func, void* data) {
+    KASSERT(hook);
+    KASSERT(func);
+    hook->func = func;
+    hook->data = data;
+    hook->queue = NULL;
+    hook->prev = NULL;
+    hook->next = NULL;
+}
+
+/*
+ * Register a hook at the tail of a queue's hook list.
+ * Called with interrupts disabled.
+ */
+void waitHookAdd(thread_queue_t* queue, wait_hook_t* hook) {
+    KASSERT(!interruptsEnabled());
+    KASSERT(queue);
+    KASSERT(hook);
+    KASSERT(hook->queue == NULL);
+
+    hook->queue = queue;
+    hook->next = NULL;
+
+    if (queue->hooks == NULL) {
+        /* head's prev points to the tail, for O(1) append */
+        hook->prev = hook;
+        queue->hooks = hook;
+    } else {
+        wait_hook_t* tail = queue->hooks->prev;
+        hook->prev = tail;
+        tail->next = hook;
+        queue->hooks->prev = hook;
+    }
+}
+
+/*
+ * Unregister a hook (if it is registered) in O(1).
+ * Called with interrupts disabled.
+ */
+void waitHookRemove(wait_hook_t* hook) {
+    KASSERT(!interruptsEnabled());
+    KASSERT(hook);
+
+    thread_queue_t* queue = hook->queue;
+    if (queue == NULL) {
+        return;
+    }
+
+    if (hook == queue->hooks) {
+        queue->hooks = hook->next;
+        if (queue->hooks != NULL) {
+            queue->hooks->prev = hook->prev;
+        }
+    } else {
+        hook->prev->next = hook->next;
+        if (hook->next != NULL) {
+            hook->next->prev = hook->prev;
+        } else {
+            /* removed the tail */
+            queue->hooks->prev = hook->prev;
+        }
+    }
+
+    hook->queue = NULL;
+    hook->prev = NULL;
+    hook->next = NULL;
+}
+
+/*
+ * Add thread to run queue so it will be scheduled.
+ * If it should run before the current thread, request a reschedule;
+ * the switch happens on return from the interrupt or system call,
+ * or at the next preemption point.
+ */
+void makeRunnable(thread_t* thread) {
+    KASSERT(!interruptsEnabled());
+    KASSERT(thread);
+    enqueueRunnable(thread);
+
+    thread_t* current = g_current_thread;
+    if (current != NULL && thread != current && runsBefore(thread, current)) {
+        g_need_reschedule = true;
+    }
+}
+
+/*
+ * Assumes interrupts are enabled before
+ * atomically making thread runnable
+ */
+void makeRunnableAtomic(thread_t* thread) {
+    KASSERT(thread);
+
+    cli();
+    makeRunnable(thread);
+    sti();
+}
+
+/*
+ * Schedule a runnable thread.
+ * Called with interrupts disabled.
+ * g_current_thread should already be place on another
+ * queue (or left on run queue)
+ */
+void schedule(void) {
+    KASSERT(!interruptsEnabled());
+
+    /* a thread may block with preemption disabled; the count is per
+     * thread, so it does not carry over to the next thread */
+
+    thread_t* current = g_current_thread;
+    KASSERT(current);
+
+    if (schedClass(current) == SCHED_FAIR) {
+        fairStop(current);
+    }
+
+    if (!current->onRunQueue) {
+        mlfqCreditEarlyRelease(current);
+    }
+
+    thread_t* runnable = getNextRunnable();
+
+    KASSERT(runnable);
+
+    /* any pending reschedule is satisfied by this switch */
+    g_need_reschedule = false;
+
+    /* readers never sleep, so the old thread is not in a read-side section */
+    KASSERT(current->rcuNesting == 0);
+    rcuQuiescentState();
 
     /* DEBUGF("switching from thread %d to thread %d\n", */
             /* g_current_thread->id, runnable->id); */
@@ -746,6 +1918,11 @@ void schedulerInit(void) {
     thread_t* mainThread = (thread_t*)&mainThreadAddr;
     KASSERT(mainThread);
 
+    mutexInit(&allThreadsLock);
+    rbInit(&fairGroups, groupVruntimeLess);
+    rbInit(&deadlineTree, deadlineLess);
+    schedGroupInit(&g_defaultGroup, "default", FAIR_WEIGHT_DEFAULT);
+
     initThread(mainThread, (void*)&kernelStackBottom,
             NULL, PRIORITY_NORMAL, true);
     g_current_thread = mainThread;
@@ -761,8 +1938,9 @@ void dumpThreadInfo(thread_t* th) {
     KASSERT(th);
     DEBUGF("esp: 0x%X\n", th->esp);
     DEBUGF("numTicks: %u\n", th->numTicks);
+    DEBUGF("policy: %u, MLFQ level: %u\n", th->policy, th->mlfqLevel);
     DEBUGF("user esp: 0x%X\n", th->userEsp);
-    DEBUGF("sleepUntil: %u\n", th->sleepUntil);
+    DEBUGF("sleeping: %s\n", th->sleepTimer.pending ? "yes" : "no");
     DEBUGF("queueNext: 0x%0X\n", th->queueNext);
     DEBUGF("listNext: 0x%0X\n", th->listNext);
 }
@@ -773,20 +1951,21 @@ void dumpThreadInfo(thread_t* th) {
 void dumpAllThreadsList(void) {
     thread_t* thread;
     int count = 0;
-    bool iFlag = begIntAtomic();
+    rcuReadLock();
 
-    thread = allThreadHead;
+    thread = rcuDereference(allThreadHead);
 
     kprintf("[");
     while (thread != NULL) {
+        thread_t* next = rcuDereference(thread->listNext);
         ++count;
-        kprintf("<%x %x>", (uintptr_t)thread, (uintptr_t)thread->listNext);
-        thread = thread->listNext;
+        kprintf("<%x %x>", (uintptr_t)thread, (uintptr_t)next);
+        thread = next;
     }
     kprintf("]\n");
     kprintf("%d threads are running\n", count);
 
-    endIntAtomic(iFlag);
+    rcuReadUnlock();
 }
 
 /*
@@ -796,18 +1975,116 @@ thread_t* getCurrentThread(void) {
     return g_current_thread;
 }
 
-static void mutexWait(mutex_t *mutex) {
+/*
+ * Highest priority among a thread's base priority and the waiters of
+ * the mutexes it holds (each wait queue has its best waiter at the head)
+ */
+static priority_t inheritedPriority(thread_t* thread) {
+    priority_t priority = thread->basePriority;
+
+    for (mutex_t* mutex = thread->heldMutexes; mutex != NULL; mutex = mutex->heldNext) {
+        thread_t* waiter = mutex->waitQueue.head;
+        if (waiter != NULL && waiter->priority > priority) {
+            priority = waiter->priority;
+        }
+    }
+
+    return priority;
+}
+
+/*
+ * Change a thread's effective priority, keeping the queues it is on
+ * in order. Called with interrupts disabled.
+ */
+static void setEffectivePriority(thread_t* thread, priority_t priority) {
+    KASSERT(!interruptsEnabled());
+
+    bool lowered = priority < thread->priority;
+
+    bool queued = schedDetach(thread);
+    thread_queue_t* waitQueue = thread->waitQueue;
+    if (waitQueue != NULL) {
+        dequeueThread(waitQueue, thread);
+    }
+
+    thread->priority = priority;
+
+    if (waitQueue != NULL) {
+        enqueueThread(waitQueue, thread);
+    }
+    schedAttach(thread, queued);
+
+    thread_t* current = g_current_thread;
+    if ((thread == current && lowered) ||
+            (queued && current != NULL && runsBefore(thread, current))) {
+        g_need_reschedule = true;
+    }
+}
+
+/*
+ * Bring the effective priority of a mutex's owner up to date, then
+ * that of the owner of the mutex it waits for, and so on, until a
+ * priority stays the same.
+ * Called with interrupts disabled.
+ */
+static void mutexPropagate(mutex_t* mutex) {
+    KASSERT(!interruptsEnabled());
+
+    while (mutex != NULL && mutex->owner != NULL) {
+        thread_t* owner = mutex->owner;
+        priority_t priority = inheritedPriority(owner);
+        if (priority == owner->priority) {
+            break;
+        }
+
+        setEffectivePriority(owner, priority);
+        mutex = owner->blockedOn;
+    }
+}
+
+/*
+ * Wait on the mutex's wait queue, for at most `ticks` timer ticks
+ * (WAIT_FOREVER: no limit). Our preemption count stays with us,
+ * so other threads run normally meanwhile.
+ */
+static void mutexWait(mutex_t *mutex, uint32_t ticks) {
     KASSERT(mutex);
     KASSERT(mutex->locked);
-    KASSERT(g_preemption_disabled);
+    KASSERT(!preemptionEnabled());
+
+    thread_t* current = g_current_thread;
+
+    cli();
+
+    current->blockedOn = mutex;
+    if (ticks == WAIT_FOREVER) {
+        wait(&mutex->waitQueue);
+    } else {
+        waitTimeout(&mutex->waitQueue, ticks);
+    }
+    current->blockedOn = NULL;
+
+    /* if we gave up waiting, the owner no longer inherits from us */
+    mutexPropagate(mutex);
+
+    sti();
+}
+
+/*
+ * Take ownership of an unlocked mutex.
+ */
+static void mutexAcquire(mutex_t* mutex) {
+    thread_t* current = g_current_thread;
+
+    mutex->locked = true;
+    mutex->owner = current;
 
     cli();
-    /* re-nable preemption since we're about to wait */
-    g_preemption_disabled = false;
-    /* wait on the mutex's wait queue */
-    wait(&mutex->waitQueue);
-    /* back in action, so politely re-enable preemption */
-    g_preemption_disabled = true;
+    mutex->heldNext = current->heldMutexes;
+    current->heldMutexes = mutex;
+
+    /* inherit from any threads still waiting */
+    mutexPropagate(mutex);
     sti();
 }
 
@@ -815,7 +2092,8 @@ void mutexInit(mutex_t* mutex) {
     KASSERT(mutex);
     mutex->locked = false;
     mutex->owner = NULL;
-    threadQueueClear(&mutex->waitQueue);
+    mutex->heldNext = NULL;
+    threadQueueInitPriority(&mutex->waitQueue);
 }
 
 void mutexLock(mutex_t* mutex) {
@@ -827,13 +2105,46 @@ void mutexLock(mutex_t* mutex) {
     KASSERT(!mutexHeld(mutex));
 
     while (mutex->locked) {
-        mutexWait(mutex);
+        mutexWait(mutex, WAIT_FOREVER);
     }
 
-    mutex->locked = true;
-    mutex->owner = g_current_thread;
+    mutexAcquire(mutex);
+
+    enablePreemption();
+}
+
+/*
+ * Like mutexLock(), but give up after the given number of milliseconds.
+ *
+ * @returns whether the mutex was acquired
+ */
+bool mutexLockTimeout(mutex_t* mutex, unsigned int milliseconds) {
+    KASSERT(interruptsEnabled());
+    KASSERT(mutex);
+
+    uint32_t deadline = getTicks() + msecsToTicks(milliseconds);
+
+    disablePreemption();
+
+    KASSERT(!mutexHeld(mutex));
+
+    while (mutex->locked) {
+        uint32_t left = ticksUntil(deadline);
+        if (left == 0) {
+            break;
+        }
+
+        mutexWait(mutex, left);
+    }
+
+    bool acquired = !mutex->locked;
+    if (acquired) {
+        mutexAcquire(mutex);
+    }
 
     enablePreemption();
+
+    return acquired;
 }
 
 void mutex_unlock(mutex_t* mutex) {
@@ -844,15 +2155,30 @@ void mutex_unlock(mutex_t* mutex) {
 
     KASSERT(mutexHeld(mutex));
 
+    thread_t* current = g_current_thread;
+
+    cli();
+
     mutex->locked = false;
     mutex->owner = NULL;
 
-    if (!threadQueueEmpty(&mutex->waitQueue)) {
-        cli();
-        wakeOne(&mutex->waitQueue);
-        sti();
+    mutex_t** m = &current->heldMutexes;
+    while (*m != mutex) {
+        m = &(*m)->heldNext;
+    }
+    *m = mutex->heldNext;
+    mutex->heldNext = NULL;
+
+    wakeOne(&mutex->waitQueue);
+
+    /* drop what was inherited through this mutex */
+    priority_t priority = inheritedPriority(current);
+    if (priority != current->priority) {
+        setEffectivePriority(current, priority);
     }
 
+    sti();
+
     enablePreemption();
 }
 
@@ -864,14 +2190,58 @@ bool mutexHeld(mutex_t* mutex) {
     return false;
 }
 
+/*
+ * Prevent the current thread from being preempted.
+ * Calls nest; preemption is enabled again once every
+ * disablePreemption() has been matched by enablePreemption().
+ */
 void disablePreemption(void) {
-    g_preemption_disabled = true;
+    KASSERT(g_current_thread);
+    ++g_current_thread->preemptCount;
 }
 
+/*
+ * Drop one level of preemption disabling. If this was the outermost
+ * level and a reschedule became due meanwhile, switch now.
+ */
 void enablePreemption(void) {
-    g_preemption_disabled = false;
+    KASSERT(g_current_thread);
+    KASSERT(g_current_thread->preemptCount > 0);
+
+    if (--g_current_thread->preemptCount == 0 &&
+            g_need_reschedule && interruptsEnabled()) {
+        yield();
+    }
 }
 
 bool preemptionEnabled(void) {
-    return !g_preemption_disabled;
+    return g_current_thread == NULL || g_current_thread->preemptCount == 0;
+}
+
+/*
+ * Explicit preemption point for long-running kernel loops.
+ * Switches away if a reschedule is pending and it is safe to do so.
+ */
+void condResched(void) {
+    if (g_need_reschedule && interruptsEnabled() &&
+            g_current_thread != NULL && g_current_thread->preemptCount == 0) {
+        yield();
+    }
+}
+
+/*
+ * Called from the interrupt stubs, with interrupts disabled, when an
+ * interrupt handler or system call requested a reschedule. If the interrupted thread
+ * has preemption disabled, the reschedule stays pending until
+ * enablePreemption() or the next interrupt.
+ */
+void preemptFromIrq(void) {
+    KASSERT(!interruptsEnabled());
+
+    if (g_current_thread == NULL || !preemptionEnabled()) {
+        return;
+    }
+
+    makeRunnable(g_current_thread);
+    schedule();
 }
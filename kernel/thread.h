@@ -29,6 +29,10 @@
 #define MAROX_THREAD_H
 
 #include "marox.h"
+#include "rbtree.h"
+#include "timer.h"
+#include "hrtimer.h"
+#include "rcu.h"
 
 /* forward declaration for now */
 struct user_context;
@@ -41,6 +45,19 @@ typedef unsigned int tlocal_key_t;
 /* global quantum (number of ticks before current thread yields) */
 enum { THREAD_QUANTUM = 4 };
 
+/*
+ * How late a thread's sleep may end, so its wakeup can be batched with
+ * others (see hrtimerStartRange): the thread's timer slack (in ns), or
+ * 1/TIMER_SLACK_DIVISOR of the sleep if that is more, up to a tick.
+ * Sleeps of a tick or longer can so always share the tick's interrupt.
+ * A thread with a slack of 0 and SCHED_DEADLINE threads get none.
+ * New threads inherit their creator's slack.
+ */
+enum {
+    TIMER_SLACK_DEFAULT = 50000,
+    TIMER_SLACK_DIVISOR = 10
+};
+
 enum priority {
     PRIORITY_IDLE = 0,
     PRIORITY_USER = 1,
@@ -50,13 +67,146 @@ enum priority {
 };
 typedef enum priority priority_t;
 
+/* scheduling policies */
+enum sched_policy {
+    SCHED_PRIORITY = 0,     /* fixed priority, FIFO among equals (default) */
+    SCHED_MLFQ,             /* multilevel feedback queue */
+    SCHED_FAIR,             /* weighted fair share by virtual runtime */
+    SCHED_DEADLINE          /* earliest deadline first (see setSchedDeadline) */
+};
+typedef enum sched_policy sched_policy_t;
+
+/*
+ * Multilevel feedback queue: level 0 is the most interactive.
+ * Threads that use up their quantum move down a level; threads that
+ * block before it ends move up. A level's quantum is
+ * MLFQ_BASE_QUANTUM << level ticks. Every MLFQ_BOOST_TICKS all
+ * MLFQ threads are moved back to level 0 so none starve.
+ *
+ * MLFQ threads run when no SCHED_PRIORITY thread above PRIORITY_IDLE
+ * is runnable.
+ */
+enum {
+    MLFQ_LEVELS = 4,
+    MLFQ_BASE_QUANTUM = 2,
+    MLFQ_BOOST_TICKS = 100
+};
+
+/*
+ * Fair share: a SCHED_FAIR thread accumulates virtual runtime at a
+ * rate inversely proportional to its weight, and the thread with the
+ * least virtual runtime runs next. Every SCHED_FAIR thread belongs to
+ * a scheduling group (e.g. one per tenant). Groups share the CPU in
+ * proportion to their weights first, so a group does not get more CPU
+ * by spawning more threads; members then share the group's part in
+ * proportion to their own weights.
+ *
+ * A group can also be given a CPU quota per period: once its members
+ * have run for `quota` ticks in the current period, the group is
+ * throttled (parked off the run queue) until the next period starts.
+ *
+ * SCHED_FAIR threads run when no SCHED_PRIORITY thread above
+ * PRIORITY_IDLE and no SCHED_MLFQ thread is runnable.
+ */
+enum {
+    FAIR_WEIGHT_DEFAULT = 1024,
+    FAIR_TICK_SCALE = 1 << 20,  /* one tick adds FAIR_TICK_SCALE / weight */
+    FAIR_WAKEUP_GRAN = FAIR_TICK_SCALE / FAIR_WEIGHT_DEFAULT,
+    FAIR_SLEEPER_CREDIT = THREAD_QUANTUM * FAIR_WAKEUP_GRAN / 2
+};
+
+struct sched_group {
+    const char* name;
+    unsigned int weight;
+
+    /* virtual runtime of the group as a whole */
+    uint64_t vruntime;
+
+    /* monotonic lower bound of the members' virtual runtimes */
+    uint64_t minVruntime;
+
+    /* runnable member threads, ordered by virtual runtime */
+    rb_tree_t runnable;
+
+    /* link in the tree of groups with runnable members */
+    rb_node_t node;
+    bool queued;
+
+    /* one of the members is the current thread */
+    bool running;
+
+    /* CPU bandwidth limit in ticks (quota 0: unlimited) */
+    uint32_t quota;
+    uint32_t period;
+    uint32_t used;              /* ticks used in the current period */
+    bool throttled;
+    ktimer_t periodTimer;       /* ends the current period */
+};
+typedef struct sched_group sched_group_t;
+
+/*
+ * Deadline: every period a SCHED_DEADLINE thread may run for
+ * `runtime` ticks, and gets them before `deadline` ticks into the
+ * period. The runnable thread with the earliest absolute deadline
+ * runs first. The budget is enforced from the timer tick: a thread
+ * that uses it up is throttled until its next period.
+ *
+ * Admission control keeps the sum of runtime/deadline over all
+ * SCHED_DEADLINE threads at or below DL_MAX_UTIL per mille, so that
+ * every admitted thread meets its deadlines and the other classes
+ * are not starved.
+ *
+ * SCHED_DEADLINE threads run before all other classes.
+ */
+enum { DL_MAX_UTIL = 950 };
+
 /* thread queues/lists */
 struct thread_queue {
     struct thread* head;
     struct thread* tail;
+
+    /* callbacks waiting on this queue in place of threads */
+    struct wait_hook* hooks;
+
+    /* threads are kept ordered by priority (see threadQueueInitPriority) */
+    bool prioritized;
 };
 typedef struct thread_queue thread_queue_t;
 
+/*
+ * A callback registered on a thread queue by a waiter that is not
+ * a thread. Hooks are removed and fired by wakeAll(), and by wakeOne()
+ * when no thread is waiting. Callbacks run with interrupts disabled.
+ */
+struct wait_hook;
+typedef void (*wait_hook_func_t)(struct wait_hook* hook);
+
+struct wait_hook {
+    wait_hook_func_t func;
+    void* data;
+
+    /* queue the hook is registered on (NULL if not registered) */
+    thread_queue_t* queue;
+    struct wait_hook* prev;
+    struct wait_hook* next;
+};
+typedef struct wait_hook wait_hook_t;
+
+
+/*
+ * One-shot completion: threads wait until some event has happened
+ * once. Waiting after complete() returns at once.
+ * complete() may be called from interrupt handlers.
+ * (Implemented in sync.c; here because threads embed one.)
+ */
+struct completion {
+    bool done;
+    thread_queue_t waitQueue;
+};
+typedef struct completion completion_t;
+
+/* no timeout; unlike 0 ticks, which means not to block at all */
+#define WAIT_FOREVER UINT32_MAX
 
 /* kernel thread definition */
 struct thread {
@@ -65,19 +215,58 @@ struct thread {
     uint32_t userEsp;
     uint32_t stackTop;
 
+    /* effective priority: basePriority, or higher while inherited
+     * from the waiters of mutexes the thread holds */
     priority_t priority;
+    priority_t basePriority;
+
+    /* mutexes held, and the mutex the thread is waiting for */
+    struct mutex* heldMutexes;
+    struct mutex* blockedOn;
+
+    /* scheduling policy and its state */
+    sched_policy_t policy;
+    bool onRunQueue;
+    unsigned int mlfqLevel;
+    unsigned int mlfqEpoch;     /* boost period mlfqLevel belongs to */
+    unsigned int weight;
+    uint64_t vruntime;
+    struct sched_group* group;
+    rb_node_t fairNode;
+    uint32_t dlRuntime;
+    uint32_t dlDeadline;
+    uint32_t dlPeriod;
+    uint32_t dlRelease;         /* start of the current period */
+    uint32_t dlAbsDeadline;
+    uint32_t dlBudget;          /* runtime left in the current period */
+    bool dlThrottled;
+    bool dlQueued;              /* in the tree of runnable deadline threads */
+    ktimer_t dlTimer;           /* replenishes the budget */
+    rb_node_t dlNode;
+
+    /* preemption is disabled while non-zero (see disablePreemption) */
+    unsigned int preemptCount;
+    /* depth of RCU read-side sections, which must not sleep */
+    unsigned int rcuNesting;
 
     void* stackBase;
     void* userStackBase;
     struct thread* owner;
     int refCount;
 
-    /* sleep */
-    uint32_t sleepUntil;
+    /* ends a sleep() or nanosleep(), up to timerSlack ns late */
+    hrtimer_t sleepTimer;
+    uint64_t timerSlack;
+
+    /* queue the thread is blocked on in wait(), if any */
+    struct thread_queue* waitQueue;
+    ktimer_t waitTimer;         /* ends a waitTimeout() */
+    bool waitAborted;           /* wait ended by timeout or cancelWait() */
+    bool waitExclusive;         /* woken only by wakeOne() or as one of wakeUp()'s N */
 
     /* join()-related members */
     bool alive;
-    struct thread_queue joinQueue;
+    completion_t exited;
     int exitCode;
 
     /* kernel thread ID and process ID */
@@ -86,8 +275,9 @@ struct thread {
     /* link to next thread in current queue */
     struct thread* queueNext;
 
-    /* link to all threads in system */
+    /* link to all threads in system (RCU protected) */
     struct thread* listNext;
+    rcu_head_t rcu;             /* defers freeing past list readers */
 
     /* array of pointers to thread-local data */
     const void* tlocalData[MAX_TLOCAL_KEYS];
@@ -97,21 +287,41 @@ typedef struct thread thread_t;
 /* Thread start functions must match this signature. */
 typedef void (*thread_startFunc_t)(uint32_t arg);
 
+/*
+ * Mutexes use priority inheritance: while a thread waits for a mutex,
+ * the owner runs with at least the waiter's priority, and so on along
+ * the chain of mutexes the owner itself waits for.
+ */
 struct mutex {
     bool locked;
     thread_t* owner;
     thread_queue_t waitQueue;
+
+    /* link in the owner's list of held mutexes */
+    struct mutex* heldNext;
 };
 typedef struct mutex mutex_t;
 
+void completionInit(completion_t* comp);
+void complete(completion_t* comp);
+void waitForCompletion(completion_t* comp);
+bool waitForCompletionTimeout(completion_t* comp, unsigned int milliseconds);
+
 
 int join(thread_t* thread);
 void sleep(unsigned int milliseconds);
+void nanosleep(uint64_t nanoseconds);
 void yield(void);
+void yieldTo(thread_t* thread);
 //void exit(int exitCode) __attribute__ ((noreturn));
 void exit(int exitCode);
 
 void wait(thread_queue_t* waitQueue);
+bool waitTimeout(thread_queue_t* waitQueue, uint32_t ticks);
+void waitExclusive(thread_queue_t* waitQueue);
+bool waitExclusiveTimeout(thread_queue_t* waitQueue, uint32_t ticks);
+void cancelWait(thread_t* thread);
+bool joinTimeout(thread_t* thread, unsigned int milliseconds, int* exitCode);
 void makeRunnable(thread_t* thread);
 void makeRunnableAtomic(thread_t* thread);
 
@@ -119,25 +329,49 @@ thread_t* spawnThread(thread_startFunc_t startFunction, uint32_t arg, priority_t
 
 void schedule(void);
 void schedulerInit();
+void wakeReaper(void);
+void schedulerTick(void);
+
+void setSchedPolicy(thread_t* thread, sched_policy_t policy);
+
+void schedGroupInit(sched_group_t* group, const char* name, unsigned int weight);
+void setSchedGroup(thread_t* thread, sched_group_t* group);
+void setTimerSlack(thread_t* thread, uint64_t slack);
+void setFairWeight(thread_t* thread, unsigned int weight);
+void schedGroupSetQuota(sched_group_t* group, unsigned int quota, unsigned int period);
+
+bool setSchedDeadline(thread_t* thread, unsigned int runtime, unsigned int deadline, unsigned int period);
+void waitNextPeriod(void);
 
 void dumpThreadInfo(thread_t*);
 void dumpAllThreadsList(void);
 
 void mutexInit(mutex_t* mutex);
 void mutexLock(mutex_t* mutex);
+bool mutexLockTimeout(mutex_t* mutex, unsigned int milliseconds);
 void mutex_unlock(mutex_t* mutex);
 bool mutexHeld(mutex_t* mutex);
 
 void threadQueueClear(thread_queue_t* queue);
+void threadQueueInitPriority(thread_queue_t* queue);
 bool threadQueueEmpty(thread_queue_t* queue);
 void wakeAll(thread_queue_t* waitQueue);
-void wakeOne(thread_queue_t* waitQueue);
+thread_t* wakeOne(thread_queue_t* waitQueue);
+void wakeUp(thread_queue_t* waitQueue, unsigned int nrExclusive);
+
+void waitHookInit(wait_hook_t* hook, wait_hook_func_t func, void* data);
+void waitHookAdd(thread_queue_t* queue, wait_hook_t* hook);
+void waitHookRemove(wait_hook_t* hook);
 
 thread_t* getCurrentThread(void);
 
+/* set when the current thread should give up the CPU */
+extern volatile int g_need_reschedule;
+
 void disablePreemption(void);
 void enablePreemption(void);
 bool preemptionEnabled(void);
+void condResched(void);
 
 /* Thread-local data functions */
 bool tlocalCreate(tlocal_key_t* key, tlocal_destructor_t destructor);
@@ -1,21 +1,42 @@
 #include "irq.h"
 #include "io.h"
+#include "int.h"
 #include "thread.h"
+#include "clock.h"
+#include "hrtimer.h"
 #include "timer.h"
 
-void setTimerFrequency(unsigned int hz) {
-    /* cmd = channel 0, LSB then MSB, Square Wave Mode, 16-bit counter */
-    uint8_t cmd = 0x36;
-    unsigned int divisor = PIT_FREQ_HZ / hz;
-    outPortB(PIT_CMD_REG, cmd);            /* Set command byte */
-    outPortB(PIT_DATA_REG0, divisor & 0xFF); /* Set low byte of divisor */
-    outPortB(PIT_DATA_REG0, divisor >> 8);   /* Set high byte of divisor */
-}
+/*
+ * PIT channel 0 runs one-shot (mode 0), programmed by the hrtimer code
+ * for the next timer to expire. The system tick is one of those timers.
+ *
+ * Between programmings, the counter tells how much time has passed,
+ * so the PIT doubles as a clock: g_pitClocks counts the PIT clocks up
+ * to the latest programming. After reaching zero, the counter keeps
+ * counting down from 0xFFFF, so the elapsed time stays unambiguous for
+ * 65536 more clocks (about 55 ms), i.e. for about 65 ms after the tick
+ * programs its 10 ms count. Interrupts must not be held off for that
+ * long, or time is lost.
+ */
+enum {
+    PIT_CMD_ONESHOT_CH0 = 0x30,     /* channel 0, LSB then MSB, mode 0 */
+    PIT_CMD_READBACK_CH0 = 0xC2,    /* latch status and count of channel 0 */
+    PIT_STATUS_OUT = 0x80,          /* output is high: count reached zero */
+    PIT_STATUS_NULL = 0x40,         /* new count not loaded yet */
+    PIT_MAX_COUNT = 0xFFFF,
+    TICK_NSEC = NSEC_PER_SEC / TICKS_PER_SEC
+};
+
+static uint64_t g_pitClocks;
+static uint16_t g_pitProgrammed;
 
 /* global count of system ticks (uptime) */
 static uint32_t g_numTicks = 0;
 
-int g_need_reschedule = false;
+static hrtimer_t g_tickTimer;
+
+/* pending ktimers, sorted by expiry */
+static ktimer_t* g_timerHead = NULL;
 
 
 /* getter for global system tick count */
@@ -23,37 +44,198 @@ uint32_t getTicks(void) {
     return g_numTicks;
 }
 
-/* Handles timer interrupt.
- * By default, the timer fires at 18.222hz
+/* wrap-safe comparison of tick counts */
+static inline bool ticksBefore(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+/* convert a duration to ticks, rounding up to at least one tick */
+unsigned int msecsToTicks(unsigned int milliseconds) {
+    unsigned int ticks = milliseconds * TICKS_PER_SEC / 1000;
+    if (ticks < 1) { ticks = 1; }
+    return ticks;
+}
+
+/* ticks left until the tick count reaches `deadline` (0 if it has) */
+uint32_t ticksUntil(uint32_t deadline) {
+    uint32_t now = getTicks();
+    return ticksBefore(now, deadline) ? deadline - now : 0;
+}
+
+void ktimerInit(ktimer_t* timer, ktimer_func_t func, void* data) {
+    KASSERT(timer);
+    KASSERT(func);
+    timer->expires = 0;
+    timer->func = func;
+    timer->data = data;
+    timer->pending = false;
+    timer->next = NULL;
+}
+
+/*
+ * (Re-)arm a timer to fire once the tick count reaches `expires`.
  */
-void timerHandler(struct regs *r) {
-    (void)r; // prevent 'unused' parameter warning
+void ktimerSet(ktimer_t* timer, uint32_t expires) {
+    KASSERT(timer);
+
+    bool iFlag = begIntAtomic();
+
+    ktimerCancel(timer);
+
+    timer->expires = expires;
+    timer->pending = true;
+
+    /* keep the list sorted; timers with equal expiry fire in FIFO order */
+    ktimer_t** t = &g_timerHead;
+    while (*t != NULL && !ticksBefore(expires, (*t)->expires)) {
+        t = &(*t)->next;
+    }
+    timer->next = *t;
+    *t = timer;
+
+    endIntAtomic(iFlag);
+}
+
+void ktimerCancel(ktimer_t* timer) {
+    KASSERT(timer);
+
+    bool iFlag = begIntAtomic();
+
+    if (timer->pending) {
+        ktimer_t** t = &g_timerHead;
+        while (*t != NULL) {
+            if (*t == timer) {
+                *t = timer->next;
+                break;
+            }
+            t = &(*t)->next;
+        }
+        timer->pending = false;
+        timer->next = NULL;
+    }
+
+    endIntAtomic(iFlag);
+}
+
+/* run the callbacks of all expired timers */
+static void runTimers(void) {
+    while (g_timerHead != NULL && !ticksBefore(g_numTicks, g_timerHead->expires)) {
+        ktimer_t* timer = g_timerHead;
+        g_timerHead = timer->next;
+        timer->next = NULL;
+        timer->pending = false;
+        /* the callback may re-arm the timer */
+        timer->func(timer);
+    }
+}
+
+/*
+ * PIT clocks since the latest programming.
+ * Called with interrupts disabled.
+ */
+static uint32_t pitElapsed(void) {
+    outPortB(PIT_CMD_REG, PIT_CMD_READBACK_CH0);
+    uint8_t status = inPortB(PIT_DATA_REG0);
+    uint32_t count = inPortB(PIT_DATA_REG0);
+    count |= inPortB(PIT_DATA_REG0) << 8;
+
+    if (status & PIT_STATUS_NULL) {
+        return 0;
+    }
+    if (status & PIT_STATUS_OUT) {
+        /* past zero and wrapped around */
+        return g_pitProgrammed + ((0x10000 - count) & 0xFFFF);
+    }
+    return g_pitProgrammed - count;
+}
+
+/*
+ * PIT clocks since timerInit(). Used by clockNanos() when there
+ * is no usable TSC.
+ */
+uint64_t pitClocks(void) {
+    bool iFlag = begIntAtomic();
+    uint64_t clocks = g_pitClocks + pitElapsed();
+    endIntAtomic(iFlag);
+    return clocks;
+}
+
+static void pitProgram(uint16_t count) {
+    /* the counter loads the new count one clock after the write */
+    g_pitClocks += pitElapsed() + 1;
+    g_pitProgrammed = count;
+
+    outPortB(PIT_CMD_REG, PIT_CMD_ONESHOT_CH0);
+    outPortB(PIT_DATA_REG0, count & 0xFF);
+    outPortB(PIT_DATA_REG0, count >> 8);
+}
+
+static void pitSetNextEvent(uint64_t delta) {
+    uint64_t count = delta * PIT_FREQ_HZ / NSEC_PER_SEC;
+    if (count < 1) {
+        count = 1;
+    }
+    if (count > PIT_MAX_COUNT) {
+        count = PIT_MAX_COUNT;
+    }
+    pitProgram(count);
+}
+
+static clock_event_t g_pitClockEvent = {
+    .name = "PIT",
+    .minDelta = 2ULL * NSEC_PER_SEC / PIT_FREQ_HZ,
+    .maxDelta = (uint64_t)PIT_MAX_COUNT * NSEC_PER_SEC / PIT_FREQ_HZ,
+    .setNextEvent = pitSetNextEvent
+};
+
+/*
+ * The system tick, every 1 / TICKS_PER_SEC seconds: ktimers and
+ * scheduler accounting run at this granularity.
+ */
+static void tickFired(hrtimer_t* timer) {
     ++g_numTicks;
 
+    runTimers();
+
     if (getCurrentThread() && getCurrentThread()->id == 5) {
         DEBUGF("%s\n", "timerHandler in user!");
     }
 
-    /* if the current thread has outlived the quantum, add it to the
-     * run queue and schedule a new thread */
-    thread_t* current = getCurrentThread();
-    if (current) {
-        if (++current->numTicks > THREAD_QUANTUM && preemptionEnabled()) {
-            // DEBUGF("preempting thread %d\n", current->id);
-            makeRunnable(current);
-            g_need_reschedule = true;
-        }
-    }
+    /* charge the tick to the current thread and preempt it
+     * if it has outlived its quantum */
+    schedulerTick();
+
+    /* relative to the previous expiry, so ticks do not drift */
+    hrtimerStart(timer, timer->expires + TICK_NSEC);
+}
+
+/* Handles timer interrupt: whichever hrtimers are due */
+void timerHandler(struct regs *r) {
+    (void)r; // prevent 'unused' parameter warning
+    hrtimerInterrupt();
 }
 
 /* installs timerHandler into IRQ0 */
 void timerInit() {
-    setTimerFrequency(TICKS_PER_SEC);
+    bool iFlag = begIntAtomic();
+
+    /* start counting, then let the hrtimers take over the PIT */
+    g_pitClocks = 0;
+    g_pitProgrammed = 0;
+    pitProgram(PIT_MAX_COUNT);
+    g_pitClocks = 0;
+    clockEventRegister(&g_pitClockEvent);
+
+    hrtimerInit(&g_tickTimer, tickFired, NULL);
+    hrtimerStart(&g_tickTimer, clockNanos() + TICK_NSEC);
+
+    endIntAtomic(iFlag);
+
     initIrqHandler(IRQ_TIMER, timerHandler);
     enableIrq(IRQ_TIMER);
 }
 
+/* busy-wait for the given number of ticks */
 void delay(unsigned int ticks) {
-    unsigned int eticks = g_numTicks + ticks;
-    while (g_numTicks < eticks);
+    udelay(ticks * (1000000 / TICKS_PER_SEC));
 }
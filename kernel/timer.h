@@ -1,6 +1,8 @@
 #ifndef MAROX_TIMER_H
 #define MAROX_TIMER_H
 
+#include "marox.h"
+
 enum { TICKS_PER_SEC = 100 };
 
 /*
@@ -41,9 +43,34 @@ enum {
     PIT_FREQ_HZ   = 1193189
 };
 
+/*
+ * One-shot callback run from the timer interrupt (with interrupts
+ * disabled) once the system tick count reaches `expires`.
+ */
+struct ktimer;
+typedef void (*ktimer_func_t)(struct ktimer* timer);
+
+struct ktimer {
+    uint32_t expires;
+    ktimer_func_t func;
+    void* data;
+    bool pending;
+
+    /* link to next timer in list of pending timers */
+    struct ktimer* next;
+};
+typedef struct ktimer ktimer_t;
+
 uint32_t getTicks(void);
 void timerInit();
 void delay(unsigned int ticks);
-void setTimerFrequency(unsigned int hz);
+uint64_t pitClocks(void);
+
+unsigned int msecsToTicks(unsigned int milliseconds);
+uint32_t ticksUntil(uint32_t deadline);
+
+void ktimerInit(ktimer_t* timer, ktimer_func_t func, void* data);
+void ktimerSet(ktimer_t* timer, uint32_t expires);
+void ktimerCancel(ktimer_t* timer);
 
 #endif /* MAROX_TIMER_H */
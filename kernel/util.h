@@ -6,6 +6,7 @@
 uint32_t getESP(void);
 uint32_t getEFlags(void);
 uint32_t getRing(void);
+uint64_t readTsc(void);
 void kreboot(void);
 void khalt(void);
 
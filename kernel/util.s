@@ -24,6 +24,12 @@ getRing:
     and eax, 0x03
     ret
 
+; return the CPU time stamp counter (in EDX:EAX)
+global readTsc
+readTsc:
+    rdtsc
+    ret
+
 global khalt
 khalt:
     cli     ; disable interrupts so the machine stays halted
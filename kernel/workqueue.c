@@ -0,0 +1,338 @@
+#include "int.h"
+#include "mem.h"
+#include "string.h"
+#include "thread.h"
+#include "workqueue.h"
+
+/*
+ * Work queues defer function calls to a fixed pool of long-lived
+ * kernel threads, so short asynchronous jobs cost a queue push instead
+ * of a full thread lifecycle (page allocation, stack setup, reaping).
+ *
+ * All work queue state is protected by disabling interrupts, so work
+ * can be submitted from interrupt handlers as well as from threads.
+ */
+
+struct worker {
+    thread_t* thread;
+    /* queue whose item this worker is currently executing */
+    workqueue_t* wq;
+};
+
+/* pool of worker threads shared by all work queues */
+static struct worker workers[WORKQUEUE_NUM_WORKERS];
+
+/* idle workers wait here for new work */
+static thread_queue_t workerWaitQueue;
+
+/* list of all work queues */
+static workqueue_t* allQueuesHead;
+
+/* queue to look at first when a worker needs work (round robin) */
+static workqueue_t* nextQueue;
+
+/* recycled work items, so that submitting rarely touches the heap */
+static work_t* freeWorkHead;
+
+/*
+ * true if sequence number a was handed out before b
+ */
+static inline bool seqBefore(unsigned int a, unsigned int b) {
+    return (int)(a - b) < 0;
+}
+
+static work_t* allocWork(void) {
+    KASSERT(!interruptsEnabled());
+
+    work_t* work = freeWorkHead;
+    if (work != NULL) {
+        freeWorkHead = work->next;
+    } else {
+        work = malloc(sizeof(work_t));
+    }
+    return work;
+}
+
+static void freeWork(work_t* work) {
+    KASSERT(!interruptsEnabled());
+    work->next = freeWorkHead;
+    freeWorkHead = work;
+}
+
+/*
+ * Is the current thread a worker executing an item of the given queue?
+ */
+static bool currentWorkerServes(workqueue_t* wq) {
+    thread_t* current = getCurrentThread();
+    for (int i = 0; i < WORKQUEUE_NUM_WORKERS; ++i) {
+        if (workers[i].thread == current && workers[i].wq == wq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool queueRunnable(workqueue_t* wq) {
+    return wq->head != NULL && wq->numActive < wq->maxActive;
+}
+
+/*
+ * Find a work queue with pending work that is below its concurrency
+ * limit, starting where the previous search left off.
+ * Called with interrupts disabled.
+ */
+static workqueue_t* findRunnableQueue(void) {
+    KASSERT(!interruptsEnabled());
+
+    workqueue_t* start = (nextQueue != NULL) ? nextQueue : allQueuesHead;
+    workqueue_t* wq = start;
+    if (wq == NULL) {
+        return NULL;
+    }
+
+    do {
+        if (queueRunnable(wq)) {
+            nextQueue = wq->listNext;
+            return wq;
+        }
+        wq = (wq->listNext != NULL) ? wq->listNext : allQueuesHead;
+    } while (wq != start);
+
+    return NULL;
+}
+
+static void removeActive(workqueue_t* wq, work_t* work) {
+    work_t** w = &wq->active;
+    while (*w != NULL) {
+        if (*w == work) {
+            *w = work->next;
+            break;
+        }
+        w = &(*w)->next;
+    }
+    work->next = NULL;
+}
+
+/*
+ * Sequence number of the oldest item that has not yet completed
+ * (or the next sequence number if the queue is idle)
+ */
+static unsigned int oldestIncomplete(workqueue_t* wq) {
+    unsigned int oldest = wq->nextSeq;
+
+    if (wq->head != NULL) {
+        oldest = wq->head->seq;
+    }
+
+    for (work_t* work = wq->active; work != NULL; work = work->next) {
+        if (seqBefore(work->seq, oldest)) {
+            oldest = work->seq;
+        }
+    }
+
+    return oldest;
+}
+
+static void worker(uint32_t arg) {
+    struct worker* self = &workers[arg];
+
+    cli();
+
+    while (true) {
+        workqueue_t* wq = findRunnableQueue();
+        if (wq == NULL) {
+            /* nothing to do... wait for workqueueSubmit() */
+            wait(&workerWaitQueue);
+            continue;
+        }
+
+        /* move item from the pending list to the active list */
+        work_t* work = wq->head;
+        wq->head = work->next;
+        if (wq->head == NULL) {
+            wq->tail = NULL;
+        }
+        work->next = wq->active;
+        wq->active = work;
+        ++wq->numActive;
+        self->wq = wq;
+
+        sti();
+        work->func(work->arg);
+        cli();
+
+        self->wq = NULL;
+        removeActive(wq, work);
+        --wq->numActive;
+        freeWork(work);
+
+        /* let flushing threads re-check their progress */
+        wakeAll(&wq->flushQueue);
+    }
+}
+
+/*
+ * Start the shared pool of worker threads.
+ * Must be called after the scheduler is initialized.
+ */
+void workqueueInit(void) {
+    for (int i = 0; i < WORKQUEUE_NUM_WORKERS; ++i) {
+        workers[i].wq = NULL;
+        workers[i].thread = spawnThread(worker, i, PRIORITY_NORMAL, true, false);
+        /* work may be short or CPU-bound; let MLFQ sort it out */
+        setSchedPolicy(workers[i].thread, SCHED_MLFQ);
+    }
+}
+
+/*
+ * Create a named work queue. At most `maxActive` of its items execute
+ * at the same time (0 means as many as there are workers).
+ *
+ * @returns NULL if out of memory
+ */
+workqueue_t* workqueueCreate(const char* name, unsigned int maxActive) {
+    KASSERT(name);
+
+    workqueue_t* wq = malloc(sizeof(workqueue_t));
+    if (!wq) {
+        kprintf("Failed to allocate work queue %s\n", name);
+        return NULL;
+    }
+
+    memset(wq, 0, sizeof(workqueue_t));
+    strncpy(wq->name, name, WORKQUEUE_NAME_LEN - 1);
+    wq->name[WORKQUEUE_NAME_LEN - 1] = '\0';
+
+    if (maxActive == 0 || maxActive > WORKQUEUE_NUM_WORKERS) {
+        maxActive = WORKQUEUE_NUM_WORKERS;
+    }
+    wq->maxActive = maxActive;
+    threadQueueClear(&wq->flushQueue);
+
+    bool iFlag = begIntAtomic();
+    wq->listNext = allQueuesHead;
+    allQueuesHead = wq;
+    endIntAtomic(iFlag);
+
+    return wq;
+}
+
+/*
+ * Drain a work queue and free it.
+ */
+void workqueueDestroy(workqueue_t* wq) {
+    KASSERT(wq);
+
+    workqueueDrain(wq);
+
+    cli();
+
+    workqueue_t** q = &allQueuesHead;
+    while (*q != NULL) {
+        if (*q == wq) {
+            *q = wq->listNext;
+            break;
+        }
+        q = &(*q)->listNext;
+    }
+    if (nextQueue == wq) {
+        nextQueue = wq->listNext;
+    }
+
+    sti();
+
+    free(wq);
+}
+
+/*
+ * Queue a call of `func(arg)` on a work queue.
+ * May be called from interrupt handlers.
+ *
+ * Work functions must return rather than call exit(), since they
+ * run on shared worker threads.
+ *
+ * @returns false if out of memory or the queue is being drained
+ */
+bool workqueueSubmit(workqueue_t* wq, work_func_t func, uint32_t arg) {
+    KASSERT(wq);
+    KASSERT(func);
+
+    bool iFlag = begIntAtomic();
+
+    /* while draining, only chained work from the queue itself is allowed */
+    if (wq->draining && !currentWorkerServes(wq)) {
+        endIntAtomic(iFlag);
+        return false;
+    }
+
+    work_t* work = allocWork();
+    if (!work) {
+        endIntAtomic(iFlag);
+        kprintf("Failed to allocate work for queue %s\n", wq->name);
+        return false;
+    }
+
+    work->func = func;
+    work->arg = arg;
+    work->seq = wq->nextSeq++;
+    work->next = NULL;
+
+    if (wq->tail == NULL) {
+        wq->head = work;
+    } else {
+        wq->tail->next = work;
+    }
+    wq->tail = work;
+
+    /* if the queue is at its limit, a finishing worker will pick it up */
+    if (wq->numActive < wq->maxActive) {
+        wakeOne(&workerWaitQueue);
+    }
+
+    endIntAtomic(iFlag);
+
+    return true;
+}
+
+/*
+ * Wait until all work submitted to the queue before this call
+ * has completed. Work submitted meanwhile is not waited for.
+ * Interrupts must be enabled.
+ */
+void workqueueFlush(workqueue_t* wq) {
+    KASSERT(interruptsEnabled());
+    KASSERT(wq);
+    /* a work item waiting on its own queue could wait forever */
+    KASSERT(!currentWorkerServes(wq));
+
+    cli();
+
+    unsigned int target = wq->nextSeq;
+    while (seqBefore(oldestIncomplete(wq), target)) {
+        wait(&wq->flushQueue);
+    }
+
+    sti();
+}
+
+/*
+ * Wait until the queue is completely empty. While draining, new work
+ * is only accepted from the queue's own work items, so chains of work
+ * run to completion but outside submitters cannot keep it busy forever.
+ * Interrupts must be enabled.
+ */
+void workqueueDrain(workqueue_t* wq) {
+    KASSERT(interruptsEnabled());
+    KASSERT(wq);
+    KASSERT(!currentWorkerServes(wq));
+
+    cli();
+
+    wq->draining = true;
+    while (wq->head != NULL || wq->numActive > 0) {
+        wait(&wq->flushQueue);
+    }
+    wq->draining = false;
+
+    sti();
+}
@@ -0,0 +1,64 @@
+#ifndef MAROX_WORKQUEUE_H
+#define MAROX_WORKQUEUE_H
+
+#include "marox.h"
+#include "thread.h"
+
+/* number of long-lived worker threads shared by all work queues */
+enum { WORKQUEUE_NUM_WORKERS = 4 };
+
+enum { WORKQUEUE_NAME_LEN = 16 };
+
+/* Work functions must match this signature. */
+typedef void (*work_func_t)(uint32_t arg);
+
+/* a single deferred function call */
+struct work {
+    work_func_t func;
+    uint32_t arg;
+
+    /* submission order, used by workqueueFlush() */
+    unsigned int seq;
+
+    /* link to next item in pending, active or free list */
+    struct work* next;
+};
+typedef struct work work_t;
+
+struct workqueue {
+    char name[WORKQUEUE_NAME_LEN];
+
+    /* max number of items of this queue executing at once */
+    unsigned int maxActive;
+
+    /* pending items, in FIFO order */
+    work_t* head;
+    work_t* tail;
+
+    /* items currently being executed by workers */
+    work_t* active;
+    unsigned int numActive;
+
+    unsigned int nextSeq;
+
+    /* when set, only work items of this queue may submit new work */
+    bool draining;
+
+    /* threads waiting in workqueueFlush() */
+    thread_queue_t flushQueue;
+
+    /* link to next queue in list of all work queues */
+    struct workqueue* listNext;
+};
+typedef struct workqueue workqueue_t;
+
+void workqueueInit(void);
+
+workqueue_t* workqueueCreate(const char* name, unsigned int maxActive);
+void workqueueDestroy(workqueue_t* wq);
+
+bool workqueueSubmit(workqueue_t* wq, work_func_t func, uint32_t arg);
+void workqueueFlush(workqueue_t* wq);
+void workqueueDrain(workqueue_t* wq);
+
+#endif /* MAROX_WORKQUEUE_H */
@@ -2,6 +2,7 @@
 #define MAROX_X86_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 enum {
     NULL_SEG_SELECTOR = 0x0,
@@ -33,5 +34,57 @@ struct regs {
 
 enum { KERNEL_DPL = 0, USERMODE_DPL = 3 };
 
+enum {
+    EFLAGS_ID = 1 << 21,                /* toggleable if CPUID exists */
+
+    CPUID_1_EDX_TSC = 1 << 4,
+    CPUID_1_EDX_MSR = 1 << 5,
+    CPUID_1_EDX_APIC = 1 << 9,
+    CPUID_1_ECX_TSC_DEADLINE = 1 << 24,
+    CPUID_6_EAX_ARAT = 1 << 2,          /* APIC timer always running */
+    CPUID_80000007_EDX_INVARIANT_TSC = 1 << 8,
+
+    MSR_APIC_BASE = 0x1B,
+    MSR_TSC_DEADLINE = 0x6E0
+};
+
+static inline bool cpuidSupported(void) {
+    uint32_t before, after;
+    __asm__ volatile (
+        "pushfl\n\t"
+        "popl %0\n\t"
+        "movl %0, %1\n\t"
+        "xorl %2, %1\n\t"
+        "pushl %1\n\t"
+        "popfl\n\t"
+        "pushfl\n\t"
+        "popl %1\n\t"
+        "pushl %0\n\t"
+        "popfl"
+        : "=&r" (before), "=&r" (after)
+        : "i" (EFLAGS_ID));
+    return ((before ^ after) & EFLAGS_ID) != 0;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ volatile ("cpuid"
+            : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+            : "a" (leaf), "c" (0));
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ volatile ("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile ("wrmsr" :: "c" (msr), "a" ((uint32_t)value), "d" ((uint32_t)(value >> 32)));
+}
+
+static inline void invlpg(uintptr_t addr) {
+    __asm__ volatile ("invlpg (%0)" :: "r" (addr) : "memory");
+}
+
 
 #endif /* MAROX_X86_H */